@@ -12,6 +12,7 @@
 #include <Gfx/GfxContext.hpp>
 #include <Gfx/GfxExec.hpp>
 #include <Gfx/TexturePort.hpp>
+#include <Gfx/Graph/computenode.hpp>
 #include <Gfx/Graph/filternode.hpp>
 #include <Gfx/Graph/isfnode.hpp>
 namespace Gfx::Filter
@@ -24,7 +25,13 @@ public:
   {
     auto n = std::make_unique<FilterNode>(frag);
 
-    id = exec_context->ui->register_node(std::move(n));
+    id = exec_context->ui->register_node(std::move(n), mailbox);
+  }
+
+  filter_node(std::unique_ptr<NodeModel> n, GfxExecutionAction& ctx)
+    : gfx_exec_node{ctx}
+  {
+    id = exec_context->ui->register_node(std::move(n), mailbox);
   }
 
   filter_node(const isf::descriptor& isf, const QString& frag, GfxExecutionAction& ctx)
@@ -32,7 +39,7 @@ public:
   {
     auto n = std::make_unique<ISFNode>(isf, frag);
 
-    id = exec_context->ui->register_node(std::move(n));
+    id = exec_context->ui->register_node(std::move(n), mailbox);
   }
 
   ~filter_node() { exec_context->ui->unregister_node(id); }
@@ -51,7 +58,12 @@ ProcessExecutorComponent::ProcessExecutorComponent(
 
     const auto& desc = element.isfDescriptor();
 
-    auto n = desc.inputs.empty()
+    auto n = element.isCompute()
+        ? std::make_shared<filter_node>(
+          std::make_unique<ComputeNode>(element.processedFragment()),
+          ctx.doc.plugin<DocumentPlugin>().exec
+          )
+        : desc.inputs.empty()
         ? std::make_shared<filter_node>(
           element.processedFragment(),
           ctx.doc.plugin<DocumentPlugin>().exec
@@ -89,6 +101,19 @@ ProcessExecutorComponent::ProcessExecutorComponent(
       }
     }
     n->root_outputs().push_back(new ossia::value_outlet);
+    // The storage buffers written by a compute shader
+    for (std::size_t o = 1; o < element.outlets().size(); o++)
+      n->root_outputs().push_back(new ossia::value_outlet);
+
+    // Edits which keep the inlets are applied to the running node
+    QObject::connect(
+        &element,
+        &Gfx::Filter::Model::processedFragmentChanged,
+        this,
+        [weak_node](const QString& frag) {
+          if (auto n = weak_node.lock())
+            n->exec_context->ui->update_shader(n->id, frag);
+        });
 
     this->node = n;
     m_ossia_process = std::make_shared<ossia::node_process>(n);
@@ -3,11 +3,19 @@
 #include <Process/Dataflow/Port.hpp>
 #include <Process/Dataflow/WidgetInlets.hpp>
 
+#include <QDebug>
 #include <QFileInfo>
-#include <QShaderBaker>
+#include <QJsonDocument>
+#include <QRegularExpression>
+#include <QShader>
 
+#include <optional>
+#include <stdexcept>
+
+#include <Gfx/Graph/computenode.hpp>
 #include <Gfx/Graph/node.hpp>
 #include <Gfx/Graph/nodes.hpp>
+#include <Gfx/Graph/shadercache.hpp>
 #include <Gfx/TexturePort.hpp>
 #include <wobjectimpl.h>
 W_OBJECT_IMPL(Gfx::Filter::Model)
@@ -70,36 +78,121 @@ void main()
 Model::~Model() {}
 
 
+// What the inlets are created from: as long as it does not change,
+// a running node can swap its shader in place.
+static QByteArray shaderInterface(const QString& fragment, QShader::Stage stage)
+{
+  const auto d = ShaderCache::instance().reflect(fragment, stage);
+
+  QByteArray res = QByteArray::number(stage) + ';';
+  for (auto& s : d.combinedImageSamplers())
+    res += s.name + ':' + QByteArray::number(s.binding) + ';';
+
+  for (auto& ub : d.uniformBlocks())
+  {
+    if (ub.blockName != "material_t")
+      continue;
+
+    res += QByteArray::number(ub.size) + ';';
+    for (auto& u : ub.members)
+      res += u.name + ':' + QByteArray::number(u.type) + '@'
+             + QByteArray::number(u.offset) + ';';
+  }
+
+  if (stage == QShader::ComputeStage)
+  {
+    try
+    {
+      for (auto& buf : ComputeNode::storageBuffers(fragment))
+        res += QByteArray::number(buf.size) + (buf.output ? 'o' : 'i') + ';';
+    }
+    catch (const std::exception& e)
+    {
+      res += e.what();
+    }
+  }
+  return res;
+}
+
+// The JSON header of an ISF shader: the passes, their targets and the
+// inputs with their defaults and ranges are read from it.
+static QByteArray isfHeader(const QString& fragment)
+{
+  const int begin = fragment.indexOf(QStringLiteral("/*"));
+  const int end = fragment.indexOf(QStringLiteral("*/"), begin);
+  if (begin == -1 || end == -1)
+    return {};
+
+  const auto header = fragment.mid(begin + 2, end - begin - 2).toUtf8();
+  return QJsonDocument::fromJson(header).toJson(QJsonDocument::Compact);
+}
+
 void Model::setFragment(QString f)
 {
   if (f == m_fragment)
     return;
   m_fragment = f;
 
-  for (auto inlet : m_inlets)
-    delete inlet;
-  m_inlets.clear();
+  // Compute shaders are not ISF shaders: they are run by a ComputeNode.
+  // They are recognized from the declaration of their work group size.
+  static const QRegularExpression localSize{
+      R"_(^\s*layout\s*\([^)]*\blocal_size_x\b[^)]*\)\s*in\s*;)_",
+      QRegularExpression::MultilineOption};
+  m_compute = f.contains(localSize);
 
-  try {
-    isf::parser p{{}, f.toStdString()};
-    auto isfprocessed = QString::fromStdString(p.fragment());
-    if(isfprocessed != f)
-    {
-      m_processedFragment = isfprocessed;
-      m_isfDescriptor = p.data();
-      setupIsf(m_isfDescriptor);
+  QString processed = f;
+  std::optional<isf::descriptor> isfDescriptor;
+  if (!m_compute)
+  {
+    try {
+      isf::parser p{{}, f.toStdString()};
+      auto isfprocessed = QString::fromStdString(p.fragment());
+      if(isfprocessed != f)
+      {
+        processed = isfprocessed;
+        isfDescriptor = p.data();
+      }
+    } catch(...) {
+    }
+  }
 
-      inletsChanged();
-      outletsChanged();
+  // Only the code changed: the inlets are kept and the running node
+  // gets the new shader.
+  auto layout = shaderInterface(processed, shaderStage());
+  if (isfDescriptor)
+    layout += isfHeader(f);
+  if (!m_interface.isEmpty() && layout == m_interface)
+  {
+    m_processedFragment = processed;
+    if (isfDescriptor)
+      m_isfDescriptor = std::move(*isfDescriptor);
+    processedFragmentChanged(m_processedFragment);
+    return;
+  }
+  m_interface = std::move(layout);
 
-      return;
-    }
-  } catch(...) {
+  for (auto inlet : m_inlets)
+    delete inlet;
+  m_inlets.clear();
+  // Only the texture is kept, the others are storage buffers
+  while (m_outlets.size() > 1)
+  {
+    delete m_outlets.back();
+    m_outlets.pop_back();
   }
 
-  m_isfDescriptor = {};
-  m_processedFragment = m_fragment;
-  setupNormalShader();
+  if (isfDescriptor)
+  {
+    m_processedFragment = processed;
+    m_isfDescriptor = std::move(*isfDescriptor);
+    setupIsf(m_isfDescriptor);
+  }
+  else
+  {
+    m_isfDescriptor = {};
+    m_processedFragment = m_fragment;
+    setupNormalShader();
+  }
 
   inletsChanged();
   outletsChanged();
@@ -203,18 +296,12 @@ void Model::setupIsf(const isf::descriptor& desc)
 
 void Model::setupNormalShader()
 {
-  QShaderBaker b;
-  b.setSourceString(m_fragment.toLatin1(), QShader::Stage::FragmentStage);
-
-  b.setGeneratedShaders({
-             {QShader::SpirvShader, 100},
-             {QShader::GlslShader, 120}, // Only GLSL version supported by RHI right now.
-             {QShader::HlslShader, QShaderVersion(50)},
-             {QShader::MslShader, QShaderVersion(12)},
-  });
+  // Same targets as the node which renders it, so that it is baked only once
+  QString error;
+  auto s = ShaderCache::instance().get(
+      m_fragment, shaderStage(), ShaderCache::rhiTargets(shaderStage()), error);
 
   int i = 0;
-  auto s = b.bake();
 
   const auto& d = s.description();
 
@@ -259,6 +346,27 @@ void Model::setupNormalShader()
       }
     }
   }
+
+  // The storage buffers come after the controls, as in the ComputeNode
+  if (m_compute)
+  {
+    try
+    {
+      int o = 1;
+      for (auto& buf : ComputeNode::storageBuffers(m_fragment))
+      {
+        if (buf.output)
+          m_outlets.push_back(new TextureOutlet{Id<Process::Port>(o++), this});
+        else
+          m_inlets.push_back(new TextureInlet{Id<Process::Port>(i++), this});
+      }
+    }
+    catch (const std::exception& e)
+    {
+      // The executor does not create the node either
+      qDebug() << e.what();
+    }
+  }
 }
 
 void Model::startExecution() {}
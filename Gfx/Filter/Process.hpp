@@ -10,6 +10,8 @@
 #include <Gfx/Filter/Metadata.hpp>
 #include <isf.hpp>
 
+#include <QShader>
+
 namespace isf
 {
 struct descriptor;
@@ -41,9 +43,19 @@ public:
   void setFragment(QString f);
   void fragmentChanged(const QString& f) W_SIGNAL(fragmentChanged, f);
 
+  // Sent instead of inletsChanged when the new shader has the same
+  // samplers and material_t block as the previous one.
+  void processedFragmentChanged(const QString& f)
+  W_SIGNAL(processedFragmentChanged, f);
+
   const isf::descriptor& isfDescriptor() const noexcept
   { return m_isfDescriptor; }
 
+  // Whether the shader is a compute shader instead of a fragment shader
+  bool isCompute() const noexcept { return m_compute; }
+  QShader::Stage shaderStage() const noexcept
+  { return m_compute ? QShader::ComputeStage : QShader::FragmentStage; }
+
   PROPERTY(
       QString,
       fragment READ fragment WRITE setFragment NOTIFY fragmentChanged)
@@ -61,6 +73,8 @@ private:
 
   QString m_fragment;
   QString m_processedFragment;
+  QByteArray m_interface;
+  bool m_compute{};
   isf::descriptor m_isfDescriptor;
 };
 
@@ -17,6 +17,7 @@ DocumentPlugin::DocumentPlugin(
     : score::DocumentPlugin{ctx, std::move(id), "Gfx::DocumentPlugin", parent}
 {
   auto& exec_plug = ctx.plugin<Execution::DocumentPlugin>();
+  exec.execution = &exec_plug;
   exec_plug.registerAction(exec);
 }
 
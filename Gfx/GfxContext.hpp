@@ -7,6 +7,12 @@
 
 #include <Gfx/Graph/window.hpp>
 #include <concurrentqueue.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <utility>
 namespace Gfx
 {
 
@@ -29,26 +35,244 @@ struct port_index
   }
 };
 
-using gfx_input = std::variant<ossia::value, ossia::audio_vector>;
+// From an outlet to an inlet
+using gfx_edge = std::pair<port_index, port_index>;
+
+// What an inlet received. Cleared without releasing the memory,
+// so that it can be filled again without allocating.
+struct gfx_input
+{
+  std::vector<ossia::value> values;
+  ossia::audio_vector audio;
+
+  void clear() noexcept { values.clear(); }
+};
+
+// Messages are stamped with the time at which the audio of their tick is
+// heard, so that the render thread applies them to the frames presented
+// at that time.
+using gfx_clock = std::chrono::steady_clock;
 
+// Events received during a tick: they are all applied, in order
 struct gfx_message
 {
   int32_t node_id{};
-  ossia::token_request token{};
-  std::vector<std::vector<gfx_input>> inputs;
+  gfx_clock::time_point timestamp{};
+  std::vector<gfx_input> inputs;
+};
+
+// The state of the inlets of an execution node. The execution thread
+// publishes one on each tick in a ring, so that neither thread waits for
+// the other. The render thread only applies the newest one which is due
+// for the frame it starts, thus does not replay the ticks it missed.
+struct gfx_mailbox
+{
+  struct state
+  {
+    ossia::token_request token{};
+    gfx_clock::time_point timestamp{};
+    // The last value and audio received by each inlet
+    std::vector<gfx_input> inputs;
+    // Tick at which each inlet last received something
+    std::vector<int64_t> written;
+    int64_t tick{};
+
+    // Only the inlets written at another tick are copied
+    void assign(const state& other)
+    {
+      token = other.token;
+      timestamp = other.timestamp;
+      inputs.resize(other.inputs.size());
+      written.resize(other.written.size());
+      for (std::size_t i = 0; i < other.inputs.size(); i++)
+      {
+        if (written[i] == other.written[i])
+          continue;
+
+        auto& src = other.inputs[i];
+        auto& dst = inputs[i];
+        dst.values.assign(src.values.begin(), src.values.end());
+        if (dst.audio.size() != src.audio.size())
+          dst.audio.resize(src.audio.size());
+        for (std::size_t c = 0; c < src.audio.size(); c++)
+          dst.audio[c].assign(src.audio[c].begin(), src.audio[c].end());
+        written[i] = other.written[i];
+      }
+      tick = other.tick;
+    }
+  };
+
+  // Execution thread: filled by the current tick, then published
+  state latest;
+
+  void begin_tick(std::size_t inlets)
+  {
+    latest.tick++;
+    latest.inputs.resize(inlets);
+    latest.written.resize(inlets);
+  }
+
+  void write(std::size_t inlet, const ossia::value& v)
+  {
+    auto& values = latest.inputs[inlet].values;
+    if (values.empty())
+      values.push_back(v);
+    else
+      values.front() = v;
+    latest.written[inlet] = latest.tick;
+  }
+
+  void write(std::size_t inlet, const ossia::audio_vector& v)
+  {
+    auto& audio = latest.inputs[inlet].audio;
+    if (audio.size() != v.size())
+      audio.resize(v.size());
+    for (std::size_t c = 0; c < v.size(); c++)
+      audio[c].assign(v[c].begin(), v[c].end());
+    latest.written[inlet] = latest.tick;
+  }
+
+  void publish()
+  {
+    const auto head = m_head.load(std::memory_order_relaxed);
+    // The render thread did not read the ring for a while, e.g. when no
+    // output is rendering: what the tick received stays in latest, and
+    // goes with the next tick which finds room.
+    if (head - m_tail.load(std::memory_order_acquire) == capacity)
+      return;
+
+    // The slot holds an older state, given back by the render thread:
+    // only the inlets which changed since then are copied.
+    m_buffers[head % capacity].assign(latest);
+    m_head.store(head + 1, std::memory_order_release);
+  }
+
+  // Render thread: the newest state due at the given time, if one was
+  // published since the last call. It stays valid until the next call.
+  // The inlets already applied can be skipped with applied.
+  const state* take(gfx_clock::time_point due)
+  {
+    // The ring is emptied on each call, even of the states which are not
+    // due yet: with a negative latency, they can be up to a second ahead,
+    // which is many more ticks than the ring holds.
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    const auto head = m_head.load(std::memory_order_acquire);
+    for (; tail != head; tail++)
+    {
+      if (m_spare.empty())
+      {
+        m_pending.emplace_back();
+      }
+      else
+      {
+        m_pending.push_back(std::move(m_spare.back()));
+        m_spare.pop_back();
+      }
+      // Nothing is copied: the slot gets an older state, whose inlets
+      // written since then are copied by the next publish.
+      std::swap(m_pending.back(), m_buffers[tail % capacity]);
+    }
+    m_tail.store(tail, std::memory_order_release);
+
+    bool found = false;
+    while (!m_pending.empty() && m_pending.front().timestamp <= due)
+    {
+      m_spare.push_back(std::move(m_current));
+      m_current = std::move(m_pending.front());
+      m_pending.pop_front();
+      found = true;
+    }
+    return found ? &m_current : nullptr;
+  }
+
+  // Tick of what the render thread applied, for each inlet
+  std::vector<int64_t> applied;
+
+private:
+  // Enough for the ticks between two frames. The states waiting for the
+  // time at which they are presented are in m_pending, which only grows
+  // with the latency. When the render thread does not read the ring for
+  // longer, the ticks are merged in latest until there is room.
+  static const constexpr uint64_t capacity = 32;
+
+  state m_buffers[capacity];
+  std::atomic<uint64_t> m_head{};
+  // The next slot to read
+  std::atomic<uint64_t> m_tail{};
+
+  // Render thread: the states read from the ring which are not due yet,
+  // the one last returned, and the ones which can be reused.
+  std::deque<state> m_pending;
+  state m_current;
+  std::vector<state> m_spare;
+};
+
+// The event messages sent by an execution node: the render thread gives
+// them back once applied, and the next ticks reuse them.
+struct gfx_message_pool
+{
+  // Only accessed by the execution thread
+  std::vector<std::unique_ptr<gfx_message>> messages;
+  moodycamel::ConcurrentQueue<gfx_message*> free_messages;
+
+  gfx_message& acquire(std::size_t inlets)
+  {
+    gfx_message* msg{};
+    if (!free_messages.try_dequeue(msg))
+    {
+      // More ticks happened between two frames than ever before
+      msg = messages.emplace_back(std::make_unique<gfx_message>()).get();
+    }
+
+    msg->inputs.resize(inlets);
+    for (auto& in : msg->inputs)
+      in.clear();
+    return *msg;
+  }
+
+  void release(gfx_message* msg) { free_messages.enqueue(msg); }
+};
+
+// Keeps the pool alive until the message is given back,
+// even if the execution node went away in the meantime.
+struct gfx_message_ref
+{
+  gfx_message* message{};
+  std::shared_ptr<gfx_message_pool> pool;
+};
+
+// Sent by the execution thread when the edges between the nodes change
+struct gfx_edge_message
+{
+  gfx_edge edge{};
+  bool added{};
+};
+
+struct gfx_shader_message
+{
+  int32_t node_id{};
+  QString fragment;
 };
 
 struct gfx_view_node
 {
   std::unique_ptr<NodeModel> impl;
+  // Shared with the execution node, if any
+  std::shared_ptr<gfx_mailbox> mailbox;
 
-  void process(const ossia::token_request& tk)
+  void process(const ossia::token_request& tk, gfx_clock::time_point timestamp)
   {
     ProcessUBO& UBO = impl->standardUBO;
-    auto prev_time = UBO.time;
 
-    UBO.time = tk.date.impl / ossia::flicks_per_second<double>;
-    UBO.timeDelta = UBO.time - prev_time;
+    // How fast the date goes, to follow it between two states
+    const double date = tk.date.impl / ossia::flicks_per_second<double>;
+    if (m_timestamp != gfx_clock::time_point{} && timestamp > m_timestamp)
+    {
+      m_interval = std::chrono::duration<double>(timestamp - m_timestamp).count();
+      m_rate = (date - m_date) / m_interval;
+    }
+    m_date = date;
+    m_timestamp = timestamp;
 
     if (tk.parent_duration.impl > 0)
       UBO.progress = tk.date.impl / double(tk.parent_duration.impl);
@@ -58,6 +282,30 @@ struct gfx_view_node
     UBO.passIndex = 0;
   }
 
+  // The time of a frame presented at the given time: each output sets it
+  // before its frame, with its own latency.
+  void present(gfx_clock::time_point t)
+  {
+    if (m_timestamp == gfx_clock::time_point{})
+      return;
+
+    // Not further than the next state, which may bring a discontinuity
+    const double ahead = std::clamp(
+        std::chrono::duration<double>(t - m_timestamp).count(), 0., m_interval);
+    impl->standardUBO.time = m_date + m_rate * ahead;
+  }
+
+  // Once per display refresh, so that the time elapsed is not divided
+  // between the outputs
+  void refresh(gfx_clock::time_point t)
+  {
+    present(t);
+
+    ProcessUBO& UBO = impl->standardUBO;
+    UBO.timeDelta = UBO.time - m_refreshTime;
+    m_refreshTime = UBO.time;
+  }
+
   void process(int32_t port, const ossia::value& v)
   {
     struct vec_visitor
@@ -174,7 +422,7 @@ struct gfx_view_node
 
     auto& in = impl->input[port];
     v.apply(value_visitor{in->type, in->value});
-    impl->materialChanged++;
+    in->version = ++impl->materialChanged;
   }
 
   void process(int32_t port, const ossia::audio_vector& v)
@@ -209,12 +457,29 @@ struct gfx_view_node
       }
     }
   }
+
+  // Last state applied
+  double m_date{};
+  gfx_clock::time_point m_timestamp{};
+  // Date per second, and seconds between the last two states
+  double m_rate{};
+  double m_interval{};
+  // Time of the last display refresh
+  double m_refreshTime{};
 };
 
+// Owns the graph, which is only used from the render thread: the nodes
+// and edges are changed there, between two frames, and the windows of the
+// outputs are rendered there. The GUI thread is only involved for the
+// events of these windows.
+// As the windows share the thread, a window blocking on the vertical sync
+// when presenting blocks the others: only the first one waits for it, and
+// the others are presented without waiting, once per display period, see
+// Window::waitsForVSync.
 class gfx_window_context : public QObject
 {
   GraphicsApi m_api{};
-  int32_t index{};
+  std::atomic_int32_t index{};
 
   ossia::fast_hash_map<int32_t, gfx_view_node> nodes;
 
@@ -222,10 +487,12 @@ class gfx_window_context : public QObject
 
   QThread m_thread;
 
-  bool must_recompute = false;
+  bool must_recompute = true;
 
 public:
-  moodycamel::ConcurrentQueue<gfx_message> tick_messages;
+  moodycamel::ConcurrentQueue<gfx_message_ref> event_messages;
+  moodycamel::ConcurrentQueue<gfx_shader_message> shader_messages;
+  moodycamel::ConcurrentQueue<gfx_edge_message> edge_messages;
 
   gfx_window_context()
   {
@@ -240,83 +507,121 @@ public:
 #endif
 
     m_graph = new Graph;
+    m_graph->renderContext = this;
+    m_graph->onFrameStart = [this](gfx_clock::time_point present, bool refresh) {
+      if (refresh)
+      {
+        m_framesStarted = true;
+        update_frame(present);
+      }
+      else
+      {
+        update_times(present);
+      }
+    };
 
-    if(m_api == Vulkan)
-    {
-      //:startTimer(16);
-      moveToThread(&m_thread);
-      m_thread.start();
-    }
+    moveToThread(&m_thread);
+    m_thread.start();
 
-    QMetaObject::invokeMethod(this, [this] { startTimer(16); },
+    // The first output starting a frame on a display refresh applies the
+    // inputs: the timer only does it when none of them is rendering.
+    QMetaObject::invokeMethod(this, [this] { startTimer(100); },
     Qt::QueuedConnection);
   }
 
   ~gfx_window_context()
   {
-    if(m_thread.isRunning())
-      m_thread.exit(0);
+    // The windows and the device are released where they were used
+    QMetaObject::invokeMethod(
+        this,
+        [this] {
+          delete m_graph;
+          m_graph = nullptr;
+          nodes.clear();
+          // Nothing else runs on the thread past this
+          m_thread.exit(0);
+        },
+        Qt::BlockingQueuedConnection);
     m_thread.wait();
   }
 
-  int32_t register_node(std::unique_ptr<NodeModel> node)
+  // Can be called from any thread: the node is added to the graph
+  // before the next frame.
+  int32_t register_node(
+      std::unique_ptr<NodeModel> node,
+      std::shared_ptr<gfx_mailbox> mailbox = {})
   {
-    auto next = index;
-    m_graph->addNode(node.get());
-    nodes[next] = {std::move(node)};
-
-    index++;
-
-    recompute_graph();
+    const int32_t next = index++;
+    QMetaObject::invokeMethod(
+        this,
+        [this, next, node = node.release(), mailbox = std::move(mailbox)] {
+          add_node(next, std::unique_ptr<NodeModel>(node), mailbox);
+        },
+        Qt::QueuedConnection);
     return next;
   }
 
+  // Can be called from any thread
   void unregister_node(int32_t idx)
   {
-    // Remove all edges involving that node
-    for (auto it = this->edges.begin(); it != this->edges.end();)
-    {
-      if (it->first.node == idx || it->second.node == idx)
-        it = this->edges.erase(it);
-      else
-        ++it;
-    }
-    auto it = nodes.find(idx);
-    if (it != nodes.end())
-    {
-      m_graph->removeNode(it->second.impl.get());
-      recompute_graph();
-    }
-    nodes.erase(it);
-
-    recompute_graph();
+    QMetaObject::invokeMethod(
+        this, [this, idx] { remove_node(idx); }, Qt::QueuedConnection);
   }
 
-  void recompute_edges()
+  bool recompute_edges()
   {
-    for (auto edge : m_graph->edges)
-    {
-      delete edge;
-    }
+    bool changed = false;
+
+    // Remove the edges which are not there anymore
+    std::vector<gfx_edge> removed;
+    for (auto& [edge, graph_edge] : graph_edges)
+      if (edges.find(edge) == edges.end())
+        removed.push_back(edge);
+    for (auto& edge : removed)
+      changed |= remove_edge(edge);
 
-    m_graph->edges.clear();
+    // Add the new ones
     for (auto edge : edges)
-    {
-      auto source_node_it = this->nodes.find(edge.first.node);
-      assert(source_node_it != this->nodes.end());
-      auto sink_node_it = this->nodes.find(edge.second.node);
-      assert(sink_node_it != this->nodes.end());
+      changed |= add_edge(edge);
 
-      assert(source_node_it->second.impl);
-      assert(sink_node_it->second.impl);
+    return changed;
+  }
 
-      auto source_port = source_node_it->second.impl->output[edge.first.port];
-      auto sink_port = sink_node_it->second.impl->input[edge.second.port];
+  // Whether the graph changed: nothing is done if the edge is already
+  // there, or if one of its nodes is not registered yet.
+  bool add_edge(gfx_edge edge)
+  {
+    if (graph_edges.find(edge) != graph_edges.end())
+      return false;
 
-      auto e = new Edge{source_port, sink_port};
-      m_graph->edges.push_back(e);
-    }
+    auto source_node_it = this->nodes.find(edge.first.node);
+    if (source_node_it == this->nodes.end())
+      return false;
+    auto sink_node_it = this->nodes.find(edge.second.node);
+    if (sink_node_it == this->nodes.end())
+      return false;
+
+    assert(source_node_it->second.impl);
+    assert(sink_node_it->second.impl);
+
+    auto source_port = source_node_it->second.impl->output[edge.first.port];
+    auto sink_port = sink_node_it->second.impl->input[edge.second.port];
+
+    graph_edges[edge] = m_graph->addEdge(source_port, sink_port);
+    return true;
   }
+
+  bool remove_edge(gfx_edge edge)
+  {
+    auto it = graph_edges.find(edge);
+    if (it == graph_edges.end())
+      return false;
+
+    m_graph->removeEdge(it->second);
+    graph_edges.erase(it);
+    return true;
+  }
+
   void recompute_graph()
   {
     recompute_edges();
@@ -326,71 +631,219 @@ public:
 
   void recompute_connections()
   {
-    recompute_edges();
-    // m_graph->setupOutputs(m_api);
-    m_graph->relinkGraph();
+    if (recompute_edges())
+      m_graph->relinkGraph();
   }
 
-  void update_inputs()
+  // Applies what is due for a frame presented at the given time
+  void update_inputs(gfx_clock::time_point present)
   {
-    struct node_vis
+    // The newest state of each node
+    m_states.clear();
+    for (auto& [id, node] : nodes)
     {
-      gfx_window_context& self;
-      gfx_view_node& node;
-      port_index sink{};
+      if (!node.mailbox)
+        continue;
 
-      void operator()(ossia::value&& v) const noexcept
+      if (auto state = node.mailbox->take(present))
+        m_states.push_back({&node, state});
+    }
+
+    // The events of the different nodes come through the same queue,
+    // but are not enqueued in the order of their ticks
+    gfx_message_ref ref;
+    while (event_messages.try_dequeue(ref))
+      m_events.push_back(std::move(ref));
+    std::stable_sort(
+        m_events.begin(), m_events.end(), [](const auto& lhs, const auto& rhs) {
+          return lhs.message->timestamp < rhs.message->timestamp;
+        });
+    std::sort(
+        m_states.begin(), m_states.end(), [](const auto& lhs, const auto& rhs) {
+          return lhs.second->timestamp < rhs.second->timestamp;
+        });
+
+    // Both are applied in the order of their ticks, so that an event does
+    // not come after a newer state
+    auto state = m_states.begin();
+    std::size_t due = 0;
+    for (;;)
+    {
+      const bool event_due = due < m_events.size()
+                             && m_events[due].message->timestamp <= present;
+      if (state != m_states.end()
+          && (!event_due
+              || state->second->timestamp <= m_events[due].message->timestamp))
       {
-        node.process(sink.port, std::move(v));
+        apply_state(*state->first, *state->second);
+        ++state;
       }
-
-      void operator()(ossia::audio_vector&& v) const noexcept
+      else if (event_due)
       {
-        node.process(sink.port, std::move(v));
+        apply_event(m_events[due]);
+        due++;
       }
-    };
+      else
+      {
+        break;
+      }
+    }
+    m_events.erase(m_events.begin(), m_events.begin() + due);
 
-    gfx_message msg;
-    while (tick_messages.try_dequeue(msg))
+    for (auto& [id, node] : nodes)
+      node.refresh(present);
+  }
+
+  // Another output starts a frame on the same display refresh
+  void update_times(gfx_clock::time_point present)
+  {
+    for (auto& [id, node] : nodes)
+      node.present(present);
+  }
+
+  // Replaces the fragment shader of a running node, keeping its ports
+  void update_shader(int32_t idx, QString fragment)
+  {
+    shader_messages.enqueue({idx, std::move(fragment)});
+  }
+
+  void update_shaders()
+  {
+    gfx_shader_message msg;
+    while (shader_messages.try_dequeue(msg))
     {
       if (auto it = nodes.find(msg.node_id); it != nodes.end())
-      {
-        auto& node = it->second;
-        node.process(msg.token);
+        m_graph->replaceShader(it->second.impl.get(), msg.fragment);
+    }
+  }
 
-        node_vis v{*this, node};
-        int32_t p = 0;
-        for (std::vector<gfx_input>& dat : msg.inputs)
-        {
-          v.sink = port_index{msg.node_id, p};
-          for (gfx_input& m : dat)
-            std::visit(v, std::move(m));
+  // Everything received since the last frame
+  void update_frame(gfx_clock::time_point present)
+  {
+    update_shaders();
+    update_inputs(present);
 
-          p++;
-        }
+    update_edges();
+  }
+
+  // Only the edges which changed are added to or removed from the graph
+  void update_edges()
+  {
+    bool changed = false;
+    gfx_edge_message msg;
+    while (edge_messages.try_dequeue(msg))
+    {
+      if (msg.added)
+      {
+        edges.insert(msg.edge);
+        changed |= add_edge(msg.edge);
+      }
+      else
+      {
+        edges.erase(msg.edge);
+        changed |= remove_edge(msg.edge);
       }
     }
+
+    if (changed)
+      m_graph->relinkGraph();
   }
 
   void timerEvent(QTimerEvent*) override
   {
-    update_inputs();
+    if (!m_framesStarted.exchange(false))
+      update_frame(gfx_clock::now());
+  }
+
+  // The edges sent by the execution thread, including the ones whose
+  // nodes are not registered yet
+  ossia::flat_set<gfx_edge> edges;
+
+private:
+  void add_node(
+      int32_t idx,
+      std::unique_ptr<NodeModel> node,
+      std::shared_ptr<gfx_mailbox> mailbox)
+  {
+    m_graph->addNode(node.get());
+    nodes[idx] = {std::move(node), std::move(mailbox)};
+
+    if (must_recompute)
+      recompute_graph();
+    else
+      recompute_connections();
+  }
+
+  // The inlets already applied from an older state are skipped
+  void apply_state(gfx_view_node& node, const gfx_mailbox::state& state)
+  {
+    node.process(state.token, state.timestamp);
 
-    if (edges_changed)
+    auto& mailbox = *node.mailbox;
+    mailbox.applied.resize(state.inputs.size());
+    for (std::size_t p = 0; p < state.inputs.size(); p++)
     {
+      if (state.written[p] <= mailbox.applied[p])
+        continue;
+      mailbox.applied[p] = state.written[p];
+
+      auto& in = state.inputs[p];
+      for (const ossia::value& v : in.values)
+        node.process(p, v);
+      if (!in.audio.empty())
+        node.process(p, in.audio);
+    }
+  }
+
+  void apply_event(gfx_message_ref& event)
+  {
+    gfx_message& msg = *event.message;
+    if (auto it = nodes.find(msg.node_id); it != nodes.end())
+    {
+      auto& node = it->second;
+      int32_t p = 0;
+      for (gfx_input& in : msg.inputs)
       {
-        std::lock_guard l{edges_lock};
-        std::swap(edges, new_edges);
+        for (ossia::value& v : in.values)
+          node.process(p, v);
+        p++;
       }
+    }
+
+    event.pool->release(event.message);
+  }
+
+  void remove_node(int32_t idx)
+  {
+    // Remove all edges involving that node
+    for (auto it = this->edges.begin(); it != this->edges.end();)
+    {
+      if (it->first.node == idx || it->second.node == idx)
+        it = this->edges.erase(it);
+      else
+        ++it;
+    }
+
+    auto it = nodes.find(idx);
+    if (it != nodes.end())
+    {
+      // Unlinking it from the outputs releases its rendered nodes
       recompute_connections();
-      edges_changed = false;
+      m_graph->removeNode(it->second.impl.get());
+      nodes.erase(it);
     }
   }
 
-  std::mutex edges_lock;
-  ossia::flat_set<std::pair<port_index, port_index>> new_edges;
-  ossia::flat_set<std::pair<port_index, port_index>> edges;
-  std::atomic_bool edges_changed{};
+  // Received, but not due yet
+  std::vector<gfx_message_ref> m_events;
+  // The states taken for the current frame
+  std::vector<std::pair<gfx_view_node*, const gfx_mailbox::state*>> m_states;
+
+  // Set when an output started a frame since the last timer event
+  std::atomic_bool m_framesStarted{};
+
+  // The edges currently instantiated in m_graph
+  ossia::flat_map<gfx_edge, Edge*> graph_edges;
 };
 
 }
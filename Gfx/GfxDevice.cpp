@@ -4,12 +4,56 @@
 
 #include <ossia-qt/name_utils.hpp>
 
+#include <score/serialization/DataStreamVisitor.hpp>
+#include <score/serialization/JSONVisitor.hpp>
+
 #include <QFormLayout>
 
 #include <Gfx/GfxApplicationPlugin.hpp>
 #include <wobjectimpl.h>
 W_OBJECT_IMPL(Gfx::GfxDevice)
 
+// Specialized before makeProtocolSpecificSettings_T and
+// serializeProtocolSpecificSettings_T use them
+template <>
+void DataStreamReader::read(const Gfx::GfxSpecificSettings& n)
+{
+  m_stream << int32_t(2) << n.latency << n.rate;
+  insertDelimiter();
+}
+
+template <>
+void DataStreamWriter::write(Gfx::GfxSpecificSettings& n)
+{
+  // The versions which did not have any settings did not write anything:
+  // what follows is the delimiter of the device settings.
+  QDataStream next{m_stream.stream.device()->peek(4)};
+  next.setByteOrder(m_stream.stream.byteOrder());
+  int32_t version{};
+  next >> version;
+  if (version == int32_t(0xDEADBEEF))
+    return;
+
+  m_stream >> version >> n.latency;
+  if (version >= 2)
+    m_stream >> n.rate;
+  checkDelimiter();
+}
+
+template <>
+void JSONObjectReader::read(const Gfx::GfxSpecificSettings& n)
+{
+  obj["Latency"] = n.latency;
+  obj["Rate"] = n.rate;
+}
+
+template <>
+void JSONObjectWriter::write(Gfx::GfxSpecificSettings& n)
+{
+  n.latency = obj["Latency"].toDouble();
+  n.rate = obj["Rate"].toDouble();
+}
+
 namespace Gfx
 {
 
@@ -80,6 +124,9 @@ bool GfxDevice::reconnect()
     if (plug)
     {
       m_protocol = new gfx_protocol{plug->exec};
+      const auto set = settings().deviceSpecificSettings.value<GfxSpecificSettings>();
+      m_protocol->latency = set.latency / 1000.;
+      m_protocol->rate = set.rate;
       m_dev = std::make_unique<gfx_device>(
           std::unique_ptr<ossia::net::protocol_base>(m_protocol), "gfx");
     }
@@ -137,6 +184,7 @@ const Device::DeviceSettings& GfxProtocolFactory::defaultSettings() const
     Device::DeviceSettings s;
     s.protocol = concreteKey();
     s.name = "Gfx";
+    s.deviceSpecificSettings = QVariant::fromValue(GfxSpecificSettings{});
     return s;
   }();
   return settings;
@@ -167,13 +215,14 @@ Device::ProtocolSettingsWidget* GfxProtocolFactory::makeSettingsWidget()
 QVariant GfxProtocolFactory::makeProtocolSpecificSettings(
     const VisitorVariant& visitor) const
 {
-  return {};
+  return makeProtocolSpecificSettings_T<GfxSpecificSettings>(visitor);
 }
 
 void GfxProtocolFactory::serializeProtocolSpecificSettings(
     const QVariant& data,
     const VisitorVariant& visitor) const
 {
+  serializeProtocolSpecificSettings_T<GfxSpecificSettings>(data, visitor);
 }
 
 bool GfxProtocolFactory::checkCompatibility(
@@ -188,8 +237,26 @@ GfxSettingsWidget::GfxSettingsWidget(QWidget* parent)
 {
   m_deviceNameEdit = new State::AddressFragmentLineEdit{this};
 
+  m_latency = new QDoubleSpinBox{this};
+  m_latency->setRange(-1000., 1000.);
+  m_latency->setSuffix(tr(" ms"));
+  m_latency->setToolTip(
+      tr("Delay between the presentation of the images and the moment they "
+         "are seen, e.g. for a projector. Negative to show them later, when "
+         "the sound takes longer to be heard."));
+
+  m_rate = new QDoubleSpinBox{this};
+  m_rate->setRange(0., 1000.);
+  m_rate->setSuffix(tr(" fps"));
+  m_rate->setSpecialValueText(tr("Display"));
+  m_rate->setToolTip(
+      tr("Frames per second presented at most, e.g. 50 for a broadcast "
+         "output on a 60 Hz display."));
+
   auto layout = new QFormLayout;
   layout->addRow(tr("Device Name"), m_deviceNameEdit);
+  layout->addRow(tr("Latency"), m_latency);
+  layout->addRow(tr("Frame rate"), m_rate);
 
   setLayout(layout);
 
@@ -199,17 +266,27 @@ GfxSettingsWidget::GfxSettingsWidget(QWidget* parent)
 void GfxSettingsWidget::setDefaults()
 {
   m_deviceNameEdit->setText("gfx");
+  m_latency->setValue(0.);
+  m_rate->setValue(0.);
 }
 
 Device::DeviceSettings GfxSettingsWidget::getSettings() const
 {
   Device::DeviceSettings s;
   s.name = m_deviceNameEdit->text();
+  s.deviceSpecificSettings
+      = QVariant::fromValue(GfxSpecificSettings{m_latency->value(), m_rate->value()});
   return s;
 }
 
 void GfxSettingsWidget::setSettings(const Device::DeviceSettings& settings)
 {
   m_deviceNameEdit->setText(settings.name);
+  if (settings.deviceSpecificSettings.canConvert<GfxSpecificSettings>())
+  {
+    const auto set = settings.deviceSpecificSettings.value<GfxSpecificSettings>();
+    m_latency->setValue(set.latency);
+    m_rate->setValue(set.rate);
+  }
 }
 }
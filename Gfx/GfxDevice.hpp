@@ -14,6 +14,10 @@ class gfx_protocol : public ossia::net::protocol_base
 public:
   gfx_protocol(GfxExecutionAction& ctx) : context{&ctx} {}
   GfxExecutionAction* context{};
+  // Of the screen, in seconds: see OutputNode::latency
+  double latency{};
+  // See OutputNode::targetRate
+  double rate{};
   bool pull(ossia::net::parameter_base&) override { return false; }
   bool push(const ossia::net::parameter_base&, const ossia::value& v) override
   {
@@ -36,10 +40,14 @@ public:
 
   gfx_parameter(ossia::net::node_base& n)
       : ossia::net::parameter_base{n}
-      , context{
-            dynamic_cast<gfx_protocol&>(n.get_device().get_protocol()).context}
   {
-    node_id = context->ui->register_node(std::make_unique<ScreenNode>());
+    auto& proto = dynamic_cast<gfx_protocol&>(n.get_device().get_protocol());
+    context = proto.context;
+
+    auto screen = std::make_unique<ScreenNode>();
+    screen->latency = proto.latency;
+    screen->targetRate = proto.rate;
+    node_id = context->ui->register_node(std::move(screen));
   }
 
   virtual ~gfx_parameter() { context->ui->unregister_node(node_id); }
@@ -56,11 +64,6 @@ public:
     return *this;
   }
 
-  void push_texture(port_index idx)
-  {
-    context->setEdge(idx, port_index{this->node_id, 0});
-  }
-
   ossia::net::parameter_base& push_value() override { return *this; }
 
   ossia::value value() const override { return {}; }
@@ -163,8 +166,18 @@ public:
 #include <Device/Protocol/ProtocolFactoryInterface.hpp>
 #include <Device/Protocol/ProtocolSettingsWidget.hpp>
 
+#include <QDoubleSpinBox>
+
 namespace Gfx
 {
+struct GfxSpecificSettings
+{
+  // In milliseconds
+  double latency{};
+  // Frames per second, zero to follow the display
+  double rate{};
+};
+
 class GfxProtocolFactory final : public Device::ProtocolFactory
 {
   SCORE_CONCRETE("5a181207-7d40-4ad8-814e-879fcdf8cc31")
@@ -240,6 +253,11 @@ public:
 private:
   void setDefaults();
   QLineEdit* m_deviceNameEdit{};
+  QDoubleSpinBox* m_latency{};
+  QDoubleSpinBox* m_rate{};
 };
 
 }
+
+Q_DECLARE_METATYPE(Gfx::GfxSpecificSettings)
+W_REGISTER_ARGTYPE(Gfx::GfxSpecificSettings)
@@ -35,6 +35,8 @@ public:
   };
   std::vector<control> controls;
   GfxExecutionAction* exec_context{};
+  std::shared_ptr<gfx_mailbox> mailbox = std::make_shared<gfx_mailbox>();
+  std::shared_ptr<gfx_message_pool> messages = std::make_shared<gfx_message_pool>();
   gfx_exec_node(GfxExecutionAction& e_ctx) : exec_context{&e_ctx} {}
 
 
@@ -60,6 +62,8 @@ public:
 
   ~gfx_exec_node()
   {
+    if (id != -1)
+      exec_context->removeNode(id);
     for(auto ctl : controls)
       delete ctl.value;
   }
@@ -83,31 +87,18 @@ public:
         }
       }
     }
-    gfx_message msg;
-    msg.node_id = id;
-    msg.token = tk;
+    mailbox->begin_tick(this->m_inlets.size());
+    mailbox->latest.token = tk;
+    mailbox->latest.timestamp = exec_context->timestamp;
+
+    // Impulses are not values which can replace each other
+    gfx_message* events{};
+
+    update_edges();
 
-    msg.inputs.resize(this->m_inlets.size());
     int inlet_i = 0;
     for (ossia::inlet* inlet : this->m_inlets)
     {
-      for (ossia::graph_edge* cable : inlet->sources)
-      {
-        if (auto src_gfx = dynamic_cast<gfx_exec_node*>(cable->out_node.get()))
-        {
-          if (src_gfx->executed())
-          {
-            int32_t port_idx = index_of(src_gfx->m_outlets, cable->out);
-            assert(port_idx != -1);
-            {
-              exec_context->setEdge(
-                  port_index{src_gfx->id, port_idx},
-                  port_index{this->id, inlet_i});
-            }
-          }
-        }
-      }
-
       switch (inlet->which())
       {
         case ossia::value_port::which:
@@ -115,14 +106,27 @@ public:
           auto& p = inlet->cast<ossia::value_port>();
           for (ossia::timed_value& val : p.get_data())
           {
-            msg.inputs[inlet_i].push_back(std::move(val.value));
+            if (val.value.target<ossia::impulse>())
+            {
+              if (!events)
+              {
+                events = &messages->acquire(this->m_inlets.size());
+                events->node_id = id;
+                events->timestamp = exec_context->timestamp;
+              }
+              events->inputs[inlet_i].values.push_back(std::move(val.value));
+            }
+            else
+            {
+              mailbox->write(inlet_i, val.value);
+            }
           }
           break;
         }
         case ossia::audio_port::which:
         {
           auto& p = inlet->cast<ossia::audio_port>();
-          msg.inputs[inlet_i].push_back(std::move(p.samples));
+          mailbox->write(inlet_i, p.samples);
           break;
         }
       }
@@ -130,18 +134,118 @@ public:
       inlet_i++;
     }
 
-    auto out
-        = this->m_outlets[0]->address.target<ossia::net::parameter_base*>();
-    if (out)
+    mailbox->publish();
+    if (events)
+      exec_context->ui->event_messages.enqueue(gfx_message_ref{events, messages});
+  }
+
+private:
+  struct gfx_source
+  {
+    gfx_exec_node* node{};
+    gfx_edge edge{};
+    bool active{};
+  };
+
+  // The cables only change when the graph is edited: on most ticks,
+  // they are just compared with the ones the sources were derived from.
+  // A cable may be allocated where a removed one was, thus its outlet is
+  // compared too.
+  bool cables_changed() const noexcept
+  {
+    std::size_t k = 0;
+    for (ossia::inlet* inlet : this->m_inlets)
     {
-      if (auto p = dynamic_cast<gfx_parameter*>(*out))
+      for (ossia::graph_edge* cable : inlet->sources)
       {
-        p->push_texture({this->id, 0});
+        if (k >= m_cables.size())
+          return true;
+        auto [c, out] = m_cables[k++];
+        if (c != cable || out != cable->out)
+          return true;
       }
     }
+    return k != m_cables.size();
+  }
 
-    exec_context->ui->tick_messages.enqueue(std::move(msg));
+  void update_sources()
+  {
+    m_cables.clear();
+    m_sources.clear();
+
+    int32_t inlet_i = 0;
+    for (ossia::inlet* inlet : this->m_inlets)
+    {
+      for (ossia::graph_edge* cable : inlet->sources)
+      {
+        m_cables.push_back({cable, cable->out});
+        if (auto src_gfx = dynamic_cast<gfx_exec_node*>(cable->out_node.get()))
+        {
+          int32_t port_idx = index_of(src_gfx->m_outlets, cable->out);
+          assert(port_idx != -1);
+          m_sources.push_back(
+              {src_gfx,
+               {port_index{src_gfx->id, port_idx}, port_index{this->id, inlet_i}}});
+        }
+      }
+      inlet_i++;
+    }
+  }
+
+  // Reports the edges ending at this node, and the one to the screen
+  // it renders to, when they differ from the last tick.
+  void update_edges()
+  {
+    bool changed = false;
+    if (cables_changed())
+    {
+      update_sources();
+      changed = true;
+    }
+
+    // Only the sources which run in this tick are rendered
+    for (gfx_source& src : m_sources)
+    {
+      const bool active = src.node->executed();
+      if (active != src.active)
+      {
+        src.active = active;
+        changed = true;
+      }
+    }
+
+    auto out
+        = this->m_outlets[0]->address.target<ossia::net::parameter_base*>();
+    auto param = out ? *out : nullptr;
+    if (param != m_screenParameter)
+    {
+      m_screenParameter = param;
+      m_screen = dynamic_cast<gfx_parameter*>(param);
+      changed = true;
+    }
+
+    if (changed)
+    {
+      m_edges.clear();
+      for (const gfx_source& src : m_sources)
+        if (src.active)
+          m_edges.push_back(src.edge);
+      if (m_screen)
+        m_edges.push_back(
+            {port_index{this->id, 0}, port_index{m_screen->node_id, 0}});
+
+      exec_context->setEdges(this->id, m_edges);
+    }
+    exec_context->ran(this->id);
   }
+
+  // What the edges were derived from
+  std::vector<std::pair<ossia::graph_edge*, ossia::outlet*>> m_cables;
+  std::vector<gfx_source> m_sources;
+  ossia::net::parameter_base* m_screenParameter{};
+  gfx_parameter* m_screen{};
+
+  std::vector<gfx_edge> m_edges;
 };
 
 struct control_updater
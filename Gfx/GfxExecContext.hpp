@@ -1,5 +1,8 @@
 #pragma once
 #include <Process/ExecutionAction.hpp>
+#include <Execution/DocumentPlugin.hpp>
+
+#include <ossia/dataflow/execution_state.hpp>
 
 #include <Gfx/GfxContext.hpp>
 
@@ -13,29 +16,116 @@ public:
   GfxExecutionAction(gfx_window_context& w) : ui{&w} {}
   gfx_window_context* ui{};
 
-  void startTick(unsigned long, double) override { edges.clear(); }
+  // Set once the execution plug-in of the document exists
+  const Execution::DocumentPlugin* execution{};
 
-  void setEdge(port_index source, port_index sink)
+  void startTick(unsigned long, double) override
   {
-    edges.insert({source, sink});
+    m_ran.clear();
+
+    auto state = execution ? execution->execState.get() : nullptr;
+    if (!state || state->sampleRate <= 0)
+      return;
+
+    // The audio clock, in seconds since the execution started. It is mapped
+    // to the render clock from the time at which the ticks start: they can
+    // start late, but not early. The slow correction follows the drift
+    // between the two clocks.
+    const double rate = state->sampleRate;
+    const double audio = state->samples_since_start / rate;
+    const auto origin = gfx_clock::now()
+                        - std::chrono::duration_cast<gfx_clock::duration>(
+                            std::chrono::duration<double>(audio));
+    if (state->samples_since_start < m_samples || origin < m_origin
+        || m_origin == gfx_clock::time_point{})
+      m_origin = origin;
+    else
+      m_origin += (origin - m_origin) / 1000;
+    m_samples = state->samples_since_start;
+
+    // The buffer computed in this tick is played after the one being played
+    const double latency = state->bufferSize / rate;
+    timestamp = m_origin
+                + std::chrono::duration_cast<gfx_clock::duration>(
+                    std::chrono::duration<double>(audio + latency));
   }
 
+  // When what is computed in the current tick is heard
+  gfx_clock::time_point timestamp{};
+
+  // Called by the nodes when the edges they render change
+  void setEdges(int32_t node, const std::vector<gfx_edge>& edges)
+  {
+    auto& e = m_edges[node];
+    e.assign(edges.begin(), edges.end());
+    m_changed = true;
+  }
+
+  // Called by each node which runs in the tick: only their edges are rendered
+  void ran(int32_t node) { m_ran.push_back(node); }
+
+  // Can be called from any thread: the edges of the node are removed on the
+  // next tick
+  void removeNode(int32_t node) { m_removed.enqueue(node); }
+
   void endTick(unsigned long, double) override
   {
-    if (edges != prev_edges)
+    int32_t removed;
+    while (m_removed.try_dequeue(removed))
+    {
+      m_edges.erase(removed);
+      m_changed = true;
+    }
+
+    if (m_ran != m_prevRan)
     {
+      std::swap(m_ran, m_prevRan);
+      m_changed = true;
+    }
+
+    if (!m_changed)
+      return;
+    m_changed = false;
+
+    edges.clear();
+    for (int32_t node : m_prevRan)
+      if (auto it = m_edges.find(node); it != m_edges.end())
+        edges.insert(it->second.begin(), it->second.end());
+
+    // Only what changed is sent to the render thread. Both sets are sorted.
+    auto prev = prev_edges.begin();
+    auto cur = edges.begin();
+    while (prev != prev_edges.end() || cur != edges.end())
+    {
+      if (cur == edges.end() || (prev != prev_edges.end() && *prev < *cur))
+        ui->edge_messages.enqueue(gfx_edge_message{*prev++, false});
+      else if (prev == prev_edges.end() || *cur < *prev)
+        ui->edge_messages.enqueue(gfx_edge_message{*cur++, true});
+      else
       {
-        std::lock_guard l{ui->edges_lock};
-        ui->new_edges = edges;
+        ++prev;
+        ++cur;
       }
-
-      prev_edges = edges;
-      ui->edges_changed = true;
     }
+
+    std::swap(prev_edges, edges);
   }
 
-  ossia::flat_set<std::pair<port_index, port_index>> prev_edges;
-  ossia::flat_set<std::pair<port_index, port_index>> edges;
+  ossia::flat_set<gfx_edge> prev_edges;
+  ossia::flat_set<gfx_edge> edges;
+
+private:
+  // The edges last reported by each node
+  ossia::fast_hash_map<int32_t, std::vector<gfx_edge>> m_edges;
+  // The nodes which ran in the current and in the previous tick
+  std::vector<int32_t> m_ran;
+  std::vector<int32_t> m_prevRan;
+  bool m_changed{};
+  moodycamel::ConcurrentQueue<int32_t> m_removed;
+
+  // Render time at which the audio clock started
+  gfx_clock::time_point m_origin{};
+  int64_t m_samples{};
 };
 
 }
@@ -0,0 +1,321 @@
+#include "computenode.hpp"
+
+#include "renderer.hpp"
+
+#include <QRegularExpression>
+
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+
+// The local size is an execution mode of the entry point
+static std::array<int, 3> spirvLocalSize(const QShader& shader)
+{
+  const QByteArray spirv
+      = shader.shader(QShaderKey{QShader::SpirvShader, QShaderVersion(100)})
+            .shader();
+  const auto words = reinterpret_cast<const uint32_t*>(spirv.constData());
+  const int count = spirv.size() / 4;
+
+  const uint32_t OpExecutionMode = 16;
+  const uint32_t ExecutionModeLocalSize = 17;
+  for (int i = 5; i < count;)
+  {
+    const uint32_t op = words[i] & 0xFFFF;
+    const uint32_t len = words[i] >> 16;
+    if (len == 0 || i + int(len) > count)
+      break;
+
+    if (op == OpExecutionMode && len >= 6 && words[i + 2] == ExecutionModeLocalSize)
+      return {int(words[i + 3]), int(words[i + 4]), int(words[i + 5])};
+    i += len;
+  }
+  return {1, 1, 1};
+}
+
+std::vector<ComputeBuffer> ComputeNode::storageBuffers(const QString& compute)
+{
+  auto blocks = ShaderCache::instance()
+                    .reflect(compute, QShader::ComputeStage)
+                    .storageBlocks();
+  std::sort(blocks.begin(), blocks.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.binding < rhs.binding;
+  });
+
+  // The qualifiers of the blocks are not reflected
+  std::vector<ComputeBuffer> res;
+  for (auto& block : blocks)
+  {
+    // Nothing tells how many elements they would have
+    for (auto& member : block.members)
+      if (member.arrayDims.contains(0))
+        throw std::runtime_error(
+            "storage block " + block.blockName.toStdString()
+            + ": runtime-sized arrays are not supported, give the array a size");
+
+    const QRegularExpression readonly{
+        QStringLiteral(R"_(\breadonly\b[\w\s]*\bbuffer\s+%1\b)_")
+            .arg(QString::fromUtf8(block.blockName))};
+    res.push_back({block.knownSize, !compute.contains(readonly)});
+  }
+  return res;
+}
+
+ComputeNode::ComputeNode(QString compute)
+{
+  setFragmentShader(compute);
+
+  // The ports are needed right away, not the baked shader
+  const auto d = ShaderCache::instance().reflect(compute, QShader::ComputeStage);
+  m_materialSize = addShaderInputs(d);
+
+  for (auto& buf : storageBuffers(compute))
+    buffers.push_back(buf);
+
+  output.push_back(new Port{this, {}, Types::Image, {}});
+  for (auto& buf : buffers)
+  {
+    auto port = new Port{this, &buf, Types::Buffer, {}};
+    (buf.output ? output : input).push_back(port);
+    bufferPorts.push_back(port);
+  }
+}
+
+ComputeNode::~ComputeNode() {}
+
+void ComputeNode::setFragmentShader(QString compute)
+{
+  m_pendingCompute = ShaderCache::instance().getAsync(compute, QShader::ComputeStage);
+  updateComputeShader(nullptr);
+}
+
+void ComputeNode::updateComputeShader(const QRhi* rhi)
+{
+  if (!m_pendingCompute)
+    return;
+
+  auto shader = ShaderCache::result(*m_pendingCompute, rhi);
+  if (!shader)
+    return;
+
+  if (shader->isValid())
+  {
+    m_computeS = *shader;
+    localSize = spirvLocalSize(m_computeS);
+    m_processMembersRead = spirvMembersRead(m_computeS, 1);
+    shadersVersion++;
+  }
+  else
+  {
+    qDebug() << m_pendingCompute->error;
+  }
+  m_pendingCompute.reset();
+}
+
+namespace
+{
+struct RenderedComputeNode : RenderedNode
+{
+  using RenderedNode::RenderedNode;
+
+  const ComputeNode& computeNode() const noexcept
+  {
+    return static_cast<const ComputeNode&>(node);
+  }
+
+  // Storage images cannot have all the formats of the render targets
+  std::optional<QRhiTexture::Format> renderTargetFormat() const noexcept override
+  {
+    return node.outputFormat.value_or(QRhiTexture::RGBA8);
+  }
+
+  QRhiTexture::Flags renderTargetFlags() const noexcept override
+  {
+    return QRhiTexture::UsedWithLoadStore;
+  }
+
+  // The buffer written by the node connected to a buffer input,
+  // or the one of this node.
+  QRhiBuffer* bufferFor(Renderer& renderer, std::size_t i)
+  {
+    auto port = computeNode().bufferPorts[i];
+    if (!port->edges.empty())
+    {
+      auto source_port = port->edges[0]->source;
+      auto source = dynamic_cast<RenderedComputeNode*>(
+          RenderedNode::sourceForInput(renderer, *port));
+      if (source && !source->m_buffers.empty())
+      {
+        auto& ports = source->computeNode().bufferPorts;
+        if (auto it = ossia::find(ports, source_port); it != ports.end())
+          return source->m_buffers[it - ports.begin()];
+      }
+    }
+    return m_buffers[i];
+  }
+
+  void updateBindings(Renderer& renderer)
+  {
+    const auto stage = QRhiShaderResourceBinding::ComputeStage;
+    auto bindings = inputBindings(renderer, stage);
+
+    int binding = 3 + m_samplers.size();
+    assert(m_texture);
+    bindings.push_back(
+        QRhiShaderResourceBinding::imageStore(binding++, stage, m_texture, 0));
+    m_boundOutput = m_texture;
+
+    m_boundBuffers.clear();
+    for (std::size_t i = 0; i < m_buffers.size(); i++)
+    {
+      auto buf = bufferFor(renderer, i);
+      bindings.push_back(
+          QRhiShaderResourceBinding::bufferLoadStore(binding++, stage, buf));
+      m_boundBuffers.push_back(buf);
+    }
+
+    m_srb->release();
+    m_srb->setBindings(bindings.begin(), bindings.end());
+    ensure(m_srb->build());
+  }
+
+  void buildPipeline(Renderer& renderer)
+  {
+    auto& rhi = *renderer.state.rhi;
+    auto& n = computeNode();
+
+    // Until the shader is baked, the target is cleared
+    m_pipelineShaders = n.shadersVersion;
+    if (!n.m_computeS.isValid())
+      return;
+    if (!rhi.isFeatureSupported(QRhi::Compute))
+    {
+      static bool warned = false;
+      if (!std::exchange(warned, true))
+        qDebug() << "Compute shaders are not supported by the graphics API in use";
+      return;
+    }
+
+    m_pipeline = rhi.newComputePipeline();
+    m_pipeline->setShaderStage({QRhiShaderStage::Compute, n.m_computeS});
+    m_pipeline->setShaderResourceBindings(m_srb);
+    ensure(m_pipeline->build());
+  }
+
+  void init(Renderer& renderer) override
+  {
+    auto& rhi = *renderer.state.rhi;
+
+    initInputs(renderer);
+
+    for (auto& buf : computeNode().buffers)
+    {
+      auto b = rhi.newBuffer(
+          QRhiBuffer::Immutable, QRhiBuffer::StorageBuffer, buf.size);
+      ensure(b->build());
+      m_buffers.push_back(b);
+    }
+    m_clearBuffers = true;
+
+    m_srb = rhi.newShaderResourceBindings();
+    updateBindings(renderer);
+
+    buildPipeline(renderer);
+  }
+
+  void relinkInputs(Renderer& renderer) override
+  {
+    RenderedNode::relinkInputs(renderer);
+
+    bool changed = m_boundOutput != m_texture;
+    for (std::size_t i = 0; i < m_buffers.size(); i++)
+      changed |= bufferFor(renderer, i) != m_boundBuffers[i];
+
+    if (changed)
+    {
+      updateBindings(renderer);
+      m_dirty = true;
+    }
+  }
+
+  void updatePipeline(Renderer& renderer) override
+  {
+    const_cast<ComputeNode&>(computeNode()).updateComputeShader(renderer.state.rhi);
+    if (m_pipelineShaders != node.shadersVersion)
+    {
+      if (m_pipeline)
+        m_pipeline->releaseAndDestroyLater();
+      m_pipeline = nullptr;
+      buildPipeline(renderer);
+      m_dirty = true;
+    }
+  }
+
+  void customUpdate(Renderer& renderer, QRhiResourceUpdateBatch& res) override
+  {
+    // The buffers start zeroed
+    if (m_clearBuffers)
+    {
+      for (auto buf : m_buffers)
+      {
+        const QByteArray zeros(buf->size(), 0);
+        res.uploadStaticBuffer(buf, zeros.constData());
+      }
+      m_clearBuffers = false;
+    }
+  }
+
+  void runPass(
+      Renderer& renderer,
+      QRhiCommandBuffer& cb,
+      QRhiResourceUpdateBatch& updateBatch) override
+  {
+    if (!m_pipeline)
+    {
+      cb.beginPass(m_renderTarget, Qt::black, {1.0f, 0}, &updateBatch);
+      cb.endPass();
+      markRendered(renderer);
+      return;
+    }
+
+    const auto sz = m_texture->pixelSize();
+    const auto& local = computeNode().localSize;
+
+    cb.beginComputePass(&updateBatch);
+    cb.setComputePipeline(m_pipeline);
+    cb.setShaderResources(m_srb);
+    cb.dispatch(
+        (sz.width() + local[0] - 1) / local[0],
+        (sz.height() + local[1] - 1) / local[1],
+        1);
+    cb.endComputePass();
+
+    markRendered(renderer);
+  }
+
+  void customRelease(Renderer&) override
+  {
+    delete m_pipeline;
+    m_pipeline = nullptr;
+
+    for (auto buf : m_buffers)
+      delete buf;
+    m_buffers.clear();
+    m_boundBuffers.clear();
+    m_boundOutput = nullptr;
+  }
+
+  QRhiComputePipeline* m_pipeline{};
+
+  // One per ComputeBuffer of the node
+  std::vector<QRhiBuffer*> m_buffers;
+  std::vector<QRhiBuffer*> m_boundBuffers;
+  QRhiTexture* m_boundOutput{};
+  bool m_clearBuffers{};
+};
+}
+
+RenderedNode* ComputeNode::createRenderer() const noexcept
+{
+  return new RenderedComputeNode{*this};
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "mesh.hpp"
+#include "node.hpp"
+
+#include <array>
+#include <list>
+
+// A storage buffer read or written by a compute node. An input which is
+// not connected gets a buffer of its own, which persists across frames.
+struct ComputeBuffer
+{
+  int size{};
+  bool output{};
+};
+
+// Dispatches a compute shader over its output image instead of drawing.
+// The shader has the same renderer_t, process_t and material_t blocks as
+// the filters, then, from binding 3:
+// - a sampler2D per image input,
+// - the image2D it writes to, in the output format (rgba8 by default),
+// - the storage buffers, in the order of their bindings.
+struct ComputeNode : NodeModel
+{
+  explicit ComputeNode(QString compute);
+  virtual ~ComputeNode();
+
+  // The buffers of the storage blocks of a compute shader: the readonly
+  // ones are inputs, the others outputs. Throws if a block has an array
+  // without a size.
+  static std::vector<ComputeBuffer> storageBuffers(const QString& compute);
+
+  const Mesh& mesh() const noexcept override { return this->m_mesh; }
+  RenderedNode* createRenderer() const noexcept override;
+
+  // Replaces the compute shader
+  void setFragmentShader(QString compute) override;
+  // Takes the compute shader once baked, as for the other nodes
+  void updateComputeShader(const QRhi* rhi);
+
+  // Stable, as they are referred to by the ports
+  std::list<ComputeBuffer> buffers;
+  std::vector<Port*> bufferPorts;
+
+  QShader m_computeS;
+  std::shared_ptr<PendingShader> m_pendingCompute;
+  std::array<int, 3> localSize{16, 16, 1};
+
+  const TexturedTriangle& m_mesh = TexturedTriangle::instance();
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include "fusion.hpp"
 #include "node.hpp"
 #include "mesh.hpp"
 
@@ -10,91 +11,31 @@ struct FilterNode : NodeModel
   {
     setShaders(m_mesh.defaultVertexShader(), frag);
 
-    const auto& d = m_fragmentS.description();
-    for (auto& ub : d.combinedImageSamplers())
-    {
-      input.push_back(new Port{this, {}, Types::Image, {}});
-    }
-    for (auto& ub : d.uniformBlocks())
-    {
-      if (ub.blockName != "material_t")
-        continue;
+    // The ports are needed right away, not the baked shader
+    m_description = ShaderCache::instance().reflect(frag, QShader::FragmentStage);
+    m_materialSize = addShaderInputs(m_description);
 
-      int sz = 0;
-      for (auto& u : ub.members)
-      {
-        switch (u.type)
-        {
-          case QShaderDescription::Int:
-          case QShaderDescription::Float:
-            sz += 4;
-            break;
-          case QShaderDescription::Int2:
-          case QShaderDescription::Vec2:
-            sz += 8;
-            if(sz % 8 != 0)
-              sz += 4;
-            break;
-          case QShaderDescription::Int3:
-          case QShaderDescription::Vec3:
-            sz += 12;
-            break;
-          case QShaderDescription::Int4:
-          case QShaderDescription::Vec4:
-            sz += 16;
-            break;
-
-          default:
-            qDebug() << "Warning ! " << u.name << "not handled ! things will go wrong !";
-            break;
-        }
-      }
+    output.push_back(new Port{this, {}, Types::Image, {}});
 
-      m_materialData.reset(new char[sz]);
-      std::fill_n(m_materialData.get(), sz, 0);
+    if (m_description.combinedImageSamplers().size() == 1)
+      fusion = FusionStage::analyze(frag);
+  }
 
-      char* cur = m_materialData.get();
-      char* orig = cur;
-      for (auto& u : ub.members)
-      {
-        switch (u.type)
-        {
-          case QShaderDescription::Int:
-            input.push_back(new Port{this, cur, Types::Int, {}});
-            cur += 4;
-            break;
-          case QShaderDescription::Float:
-            input.push_back(new Port{this, cur, Types::Float, {}});
-            cur += 4;
-            break;
-          case QShaderDescription::Int2:
-          case QShaderDescription::Vec2:
-            input.push_back(new Port{this, cur, Types::Vec2, {}});
-            cur += 8;
-            if((cur-orig) % 8 != 0)
-              cur += 4;
-            break;
-          case QShaderDescription::Int3:
-          case QShaderDescription::Vec3:
-            input.push_back(new Port{this, cur, Types::Vec3, {}});
-            cur += 12;
-            break;
-          case QShaderDescription::Int4:
-          case QShaderDescription::Vec4:
-            input.push_back(new Port{this, cur, Types::Vec4, {}});
-            cur += 16;
-            break;
+  const Mesh& mesh() const noexcept override { return this->m_mesh; }
+  virtual ~FilterNode();
 
-          default:
-            qDebug() << "Warning ! " << u.name << "not handled ! things will go wrong !";
-            break;
-        }
-      }
-    }
+  void setFragmentShader(QString frag) override
+  {
+    NodeModel::setFragmentShader(frag);
 
-    output.push_back(new Port{this, {}, Types::Image, {}});
+    m_description = ShaderCache::instance().reflect(frag, QShader::FragmentStage);
+    if (m_description.combinedImageSamplers().size() == 1)
+      fusion = FusionStage::analyze(frag);
+    else
+      fusion.reset();
   }
 
-  const Mesh& mesh() const noexcept override { return this->m_mesh; }
-  virtual ~FilterNode();
+  // Set when the shader can be fused with the filters around it
+  std::optional<FusionStage> fusion;
+  QShaderDescription m_description;
 };
@@ -0,0 +1,529 @@
+#include "fusion.hpp"
+
+#include "filternode.hpp"
+#include "renderer.hpp"
+
+#include <QRegularExpression>
+
+#include <stdexcept>
+
+namespace
+{
+// Blocks which must be declared exactly like in the default filter
+// for the stage to be fused
+static const constexpr auto rendererBlock = R"_(
+  mat4 clipSpaceCorrMatrix;
+  vec2 texcoordAdjust;
+
+  vec2 renderSize;
+)_";
+
+static const constexpr auto processBlock = R"_(
+  float time;
+  float timeDelta;
+  float progress;
+
+  int passIndex;
+  int frameIndex;
+
+  vec4 date;
+  vec4 mouse;
+  vec4 channelTime;
+
+  float sampleRate;
+)_";
+
+// Whitespace is only kept where it separates two identifiers
+static QString normalized(QString str)
+{
+  static const QRegularExpression spaces{R"_(\s+)_"};
+  static const QRegularExpression punctuation{R"_(\s*([^\w\s])\s*)_"};
+  str.replace(spaces, QStringLiteral(" "));
+  str.replace(punctuation, QStringLiteral("\\1"));
+  return str.trimmed();
+}
+
+static QString stripComments(const QString& src)
+{
+  QString res;
+  res.reserve(src.size());
+  for (int i = 0; i < src.size(); i++)
+  {
+    if (src[i] == '/' && i + 1 < src.size() && src[i + 1] == '/')
+    {
+      while (i < src.size() && src[i] != '\n')
+        i++;
+      res += '\n';
+    }
+    else if (src[i] == '/' && i + 1 < src.size() && src[i + 1] == '*')
+    {
+      i += 2;
+      while (i + 1 < src.size() && !(src[i] == '*' && src[i + 1] == '/'))
+        i++;
+      i++;
+      res += ' ';
+    }
+    else
+    {
+      res += src[i];
+    }
+  }
+  return res;
+}
+
+static bool hasTopLevelComma(const QString& str)
+{
+  int depth = 0;
+  for (QChar c : str)
+  {
+    if (c == '(' || c == '[' || c == '{')
+      depth++;
+    else if (c == ')' || c == ']' || c == '}')
+      depth--;
+    else if (c == ',' && depth == 0)
+      return true;
+  }
+  return false;
+}
+
+// Splits the shader in its global declarations: blocks, variables,
+// structs and functions.
+static std::optional<QStringList> splitDeclarations(const QString& src)
+{
+  static const QRegularExpression blockHead{R"_(\b(uniform|buffer|struct)\b)_"};
+
+  QStringList decls;
+  QString cur;
+  int depth = 0;
+  for (QChar c : src)
+  {
+    cur += c;
+    if (c == '{')
+    {
+      depth++;
+    }
+    else if (c == '}')
+    {
+      if (--depth < 0)
+        return std::nullopt;
+
+      // Blocks and structs end with a semicolon, functions do not
+      if (depth == 0 && !cur.left(cur.indexOf('{')).contains(blockHead))
+      {
+        decls.push_back(cur.trimmed());
+        cur.clear();
+      }
+    }
+    else if (c == ';' && depth == 0)
+    {
+      decls.push_back(cur.trimmed());
+      cur.clear();
+    }
+  }
+
+  if (depth != 0 || !cur.trimmed().isEmpty())
+    return std::nullopt;
+  return decls;
+}
+
+static QString sampleExpression(const QString& sampler)
+{
+  return QStringLiteral(R"_(\btexture\s*\(\s*%1\s*,\s*texcoord\s*\))_").arg(sampler);
+}
+
+static QString defines(const FusionStage& stage, int i)
+{
+  QString res;
+  for (const auto& name : stage.globals)
+    res += QStringLiteral("#define %1 s%2_%1\n").arg(name, QString::number(i));
+  return res;
+}
+
+static QString undefines(const FusionStage& stage)
+{
+  QString res;
+  for (const auto& name : stage.globals)
+    res += QStringLiteral("#undef %1\n").arg(name);
+  return res;
+}
+
+static std::optional<QShaderDescription::UniformBlock>
+materialBlock(const QShaderDescription& description)
+{
+  const auto blocks = description.uniformBlocks();
+  for (auto& ub : blocks)
+    if (ub.blockName == "material_t")
+      return ub;
+  return std::nullopt;
+}
+}
+
+std::optional<FusionStage> FusionStage::analyze(const QString& fragment)
+{
+  static const QRegularExpression inputRx{R"_(^layout\(location=0\)in vec2 v_texcoord;$)_"};
+  static const QRegularExpression outputRx{R"_(^layout\(location=0\)out vec4 (\w+);$)_"};
+  static const QRegularExpression samplerRx{R"_(^layout\(binding=\d+\)uniform sampler2D (\w+);$)_"};
+  static const QRegularExpression blockRx{R"_(^layout\(std140,binding=(\d+)\)uniform (\w+)\{(.*)\};$)_"};
+  static const QRegularExpression structRx{R"_(^struct (\w+)\{.*\};$)_"};
+  static const QRegularExpression functionRx{R"_(^(?:\w+ )+(\w+)\()_"};
+  static const QRegularExpression variableRx{R"_(^(?:\w+ )+(\w+)(?:\[\w*\])?(?:=.*)?;$)_"};
+  static const QRegularExpression memberRx{R"_(^(?:\w+ )+(\w+)(?:\[\w*\])?$)_"};
+  static const QRegularExpression swizzleRx{R"_(^([xyzw]{1,4}|[rgba]{1,4}|[stpq]{1,4})$)_"};
+  static const QRegularExpression discardRx{R"_(\bdiscard\b)_"};
+  static const QString renderer = normalized(rendererBlock);
+  static const QString process = normalized(processBlock);
+
+  // Anything done by the preprocessor would interfere with the renaming
+  QString src;
+  for (const auto& line : stripComments(fragment).split('\n'))
+  {
+    const auto trimmed = line.trimmed();
+    if (trimmed.startsWith(QStringLiteral("#version")))
+      continue;
+    if (trimmed.startsWith('#'))
+      return std::nullopt;
+    src += line;
+    src += '\n';
+  }
+
+  const auto decls = splitDeclarations(src);
+  if (!decls)
+    return std::nullopt;
+
+  FusionStage stage;
+  QString main;
+  for (const QString& decl : *decls)
+  {
+    const QString n = normalized(decl);
+    QRegularExpressionMatch m;
+    if (n.isEmpty() || n == QStringLiteral(";"))
+    {
+      continue;
+    }
+    else if (n.contains(inputRx))
+    {
+      continue;
+    }
+    else if ((m = outputRx.match(n)).hasMatch())
+    {
+      if (!stage.output.isEmpty())
+        return std::nullopt;
+      stage.output = m.captured(1);
+    }
+    else if ((m = samplerRx.match(n)).hasMatch())
+    {
+      if (!stage.sampler.isEmpty())
+        return std::nullopt;
+      stage.sampler = m.captured(1);
+    }
+    else if ((m = blockRx.match(n)).hasMatch())
+    {
+      const int binding = m.captured(1).toInt();
+      const QString name = m.captured(2);
+      const QString body = m.captured(3);
+      if (name == QStringLiteral("renderer_t") && binding == 0 && body == renderer)
+        continue;
+      if (name == QStringLiteral("process_t") && binding == 1 && body == process)
+        continue;
+      if (name != QStringLiteral("material_t") || binding != 2 || !stage.material.isEmpty())
+        return std::nullopt;
+
+      for (const auto& member : body.split(';', Qt::SkipEmptyParts))
+      {
+        auto mm = memberRx.match(member);
+        if (!mm.hasMatch() || hasTopLevelComma(member))
+          return std::nullopt;
+        stage.globals.push_back(mm.captured(1));
+      }
+      stage.material = body;
+    }
+    else if (n.startsWith(QStringLiteral("precision ")))
+    {
+      continue;
+    }
+    else if ((m = structRx.match(n)).hasMatch())
+    {
+      stage.globals.push_back(m.captured(1));
+      stage.code += decl + '\n';
+    }
+    else if (n.endsWith('}') || (n.endsWith(QStringLiteral(");")) && !n.contains('=')))
+    {
+      // Function definition or prototype
+      if (!(m = functionRx.match(n)).hasMatch())
+        return std::nullopt;
+      stage.globals.push_back(m.captured(1));
+      if (m.captured(1) == QStringLiteral("main") && n.endsWith('}'))
+        main = n;
+      stage.code += decl + '\n';
+    }
+    else if ((m = variableRx.match(n)).hasMatch() && !hasTopLevelComma(n))
+    {
+      stage.globals.push_back(m.captured(1));
+      stage.code += decl + '\n';
+    }
+    else
+    {
+      return std::nullopt;
+    }
+  }
+
+  if (stage.sampler.isEmpty() || stage.output.isEmpty() || main.isEmpty())
+    return std::nullopt;
+
+  // A discarded fragment would discard the whole chain
+  if (stage.code.contains(discardRx))
+    return std::nullopt;
+
+  stage.globals.push_back(stage.sampler);
+  stage.globals.push_back(stage.output);
+  stage.globals.removeDuplicates();
+
+  // Renaming them would break swizzles
+  for (const auto& name : stage.globals)
+    if (name.contains(swizzleRx))
+      return std::nullopt;
+
+  // Point-wise: the sampler is only used in main as texture(sampler, texcoord),
+  // with texcoord computed as in the default filter and never modified.
+  {
+    const QString code = normalized(stage.code);
+    const QRegularExpression samplerUse{QStringLiteral(R"_(\b%1\b)_").arg(stage.sampler)};
+    const QRegularExpression sample{sampleExpression(stage.sampler)};
+    const QRegularExpression texcoordDecl{
+        R"_(\bvec2 texcoord=vec2\(v_texcoord\.x,texcoordAdjust\.y\+texcoordAdjust\.x\*v_texcoord\.y\);)_"};
+    const QRegularExpression texcoordWrite{
+        R"_(\btexcoord\b(\.\w+)?([-+*/]?=(?!=)|\+\+|--)|(\+\+|--)texcoord\b)_"};
+    const QRegularExpression texcoordVar{R"_(\bvec2 texcoord\b)_"};
+
+    const auto count = [](const QString& str, const QRegularExpression& rx) {
+      int n = 0;
+      for (auto it = rx.globalMatch(str); it.hasNext(); it.next())
+        n++;
+      return n;
+    };
+
+    const int uses = count(code, samplerUse);
+    stage.pointwise = uses > 0 && count(main, sample) == uses
+                      && count(main, texcoordDecl) == 1
+                      && count(code, texcoordVar) == 1
+                      && count(code, texcoordWrite) == 1;
+  }
+
+  return stage;
+}
+
+QString fuseStages(const std::vector<const FusionStage*>& stages)
+{
+  QString res = QStringLiteral(R"_(#version 450
+layout(location = 0) in vec2 v_texcoord;
+layout(location = 0) out vec4 fragColor;
+
+layout(std140, binding = 0) uniform renderer_t {%1};
+
+layout(std140, binding = 1) uniform process_t {%2};
+)_").arg(rendererBlock, processBlock);
+
+  // The materials of all the stages in a single block, followed by what
+  // depends on the format of the intermediate textures.
+  res += QStringLiteral("\nlayout(std140, binding = 2) uniform material_t {\n");
+  for (std::size_t i = 0; i < stages.size(); i++)
+  {
+    if (stages[i]->material.isEmpty())
+      continue;
+    res += defines(*stages[i], i);
+    res += stages[i]->material;
+    res += '\n';
+    res += undefines(*stages[i]);
+  }
+  res += QStringLiteral(R"_(
+  vec3 fusion_channels;
+  float fusion_clamp;
+};
+)_");
+
+  for (std::size_t i = 0; i < stages.size(); i++)
+  {
+    const auto& stage = *stages[i];
+    res += '\n';
+    res += defines(stage, i);
+
+    QString code = stage.code;
+    if (i == 0)
+    {
+      res += QStringLiteral("layout(binding = 3) uniform sampler2D %1;\n").arg(stage.sampler);
+    }
+    else
+    {
+      // The other stages read what the previous one computed
+      res += QStringLiteral("vec4 s%1_input;\n").arg(i);
+      code.replace(
+          QRegularExpression{sampleExpression(stage.sampler)},
+          QStringLiteral("s%1_input").arg(i));
+    }
+    res += QStringLiteral("vec4 %1;\n").arg(stage.output);
+    res += code;
+    res += undefines(stage);
+  }
+
+  res += QStringLiteral("\nvoid main()\n{\n");
+  for (std::size_t i = 0; i < stages.size(); i++)
+  {
+    if (i > 0)
+    {
+      // Same as what gets sampled from an intermediate target rendered
+      // with premultiplied alpha blending over opaque black
+      res += QStringLiteral(
+                 "  s%1_input = vec4((fusion_clamp > 0. ? clamp(s%2_%3.rgb, 0., 1.) "
+                 ": s%2_%3.rgb) * fusion_channels, 1.);\n")
+                 .arg(QString::number(i), QString::number(i - 1), stages[i - 1]->output);
+    }
+    res += QStringLiteral("  s%1_main();\n").arg(i);
+  }
+  res += QStringLiteral("  fragColor = s%1_%2;\n}\n")
+             .arg(QString::number(stages.size() - 1), stages.back()->output);
+  return res;
+}
+
+namespace
+{
+struct RenderedFusedNode : RenderedNode
+{
+  using RenderedNode::RenderedNode;
+
+  // The fused material_t block is not described by input ports:
+  // it is uploaded whole when one of the stages changed.
+  void
+  customUpdate(Renderer& renderer, QRhiResourceUpdateBatch& res) override
+  {
+    auto& n = const_cast<FusedNode&>(static_cast<const FusedNode&>(node));
+    n.gatherMaterial();
+    // Written by update before the stages were gathered
+    renderer.uniforms.write(m_processUBO, &n.standardUBO);
+
+    bool uploaded = false;
+    if (m_materialSize > 0 && materialChangedIndex != n.materialChanged)
+    {
+      renderer.uniforms.write(m_materialUBO, n.material());
+      materialChangedIndex = n.materialChanged;
+      uploaded = true;
+    }
+
+    // The intermediate textures would have the format of the output
+    const auto format = m_texture ? m_texture->format() : QRhiTexture::RGBA8;
+    if (m_materialUBO && n.m_fusionOffset >= 0 && (uploaded || format != m_fusionFormat))
+    {
+      const bool singleChannel = format == QRhiTexture::R8 || format == QRhiTexture::R16
+                                 || format == QRhiTexture::RED_OR_ALPHA8;
+      const bool normalized = format != QRhiTexture::RGBA16F && format != QRhiTexture::RGBA32F;
+      const float params[4]{1.f, singleChannel ? 0.f : 1.f, singleChannel ? 0.f : 1.f, normalized ? 1.f : 0.f};
+      renderer.uniforms.write(m_materialUBO, n.m_fusionOffset, params, sizeof(params));
+      m_fusionFormat = format;
+    }
+  }
+
+  QRhiTexture::Format m_fusionFormat{QRhiTexture::UnknownFormat};
+};
+}
+
+FusedNode::FusedNode(std::vector<FilterNode*> st)
+    : stages{std::move(st)}
+{
+  std::vector<const FusionStage*> fusion;
+  for (auto stage : stages)
+    fusion.push_back(&*stage->fusion);
+
+  // The chain is rendered unfused until it is baked, see ready()
+  setShaders(m_mesh.defaultVertexShader(), fuseStages(fusion));
+
+  // The first stage samples the actual input texture: the port gets the
+  // edges of its input, see mirrorInput.
+  input.push_back(new Port{this, {}, Types::Image, {}});
+  mirrorInput();
+  outputSize = stages.front()->outputSize;
+  outputFormat = stages.front()->outputFormat;
+  output.push_back(new Port{this, {}, Types::Image, {}});
+}
+
+bool FusedNode::ready()
+{
+  if (m_ready)
+    return true;
+
+  updateShaders(nullptr);
+  if (m_pendingVertex || m_pendingFragment)
+    return false;
+  if (!m_fragmentS.isValid())
+    throw std::runtime_error("invalid fused shader");
+
+  // Where the uniforms of each stage go in the fused block
+  if (auto fused = materialBlock(m_fragmentS.description()))
+  {
+    m_materialSize = fused->size;
+    m_materialData.reset(new char[m_materialSize]);
+    std::fill_n(m_materialData.get(), m_materialSize, 0);
+
+    for (auto& f : fused->members)
+      if (f.name == "fusion_channels")
+        m_fusionOffset = f.offset;
+
+    for (std::size_t i = 0; i < stages.size(); i++)
+    {
+      auto block = materialBlock(stages[i]->m_description);
+      if (!block)
+        continue;
+
+      const QByteArray prefix = 's' + QByteArray::number(int(i)) + '_';
+      for (auto& member : block->members)
+      {
+        for (auto& f : fused->members)
+        {
+          if (f.name != prefix + member.name)
+            continue;
+
+          const int size = std::min(member.size, stages[i]->m_materialSize - member.offset);
+          if (size > 0)
+            m_materialRanges.push_back({stages[i], member.offset, f.offset, size});
+        }
+      }
+    }
+  }
+
+  m_ready = true;
+  return true;
+}
+
+FusedNode::~FusedNode() {}
+
+RenderedNode* FusedNode::createRenderer() const noexcept
+{
+  return new RenderedFusedNode{*this};
+}
+
+void FusedNode::mirrorInput() noexcept
+{
+  // The edges are not added to the Edge: only their source is read.
+  // Graph::removeEdge removes them from here too.
+  input.front()->edges = stages.front()->input.front()->edges;
+}
+
+void FusedNode::gatherMaterial() noexcept
+{
+  // The time and progress of the chain
+  standardUBO = stages.front()->standardUBO;
+
+  // Versions only ever increase: the sum changes with any of them
+  int64_t version = 0;
+  for (auto stage : stages)
+    version += stage->materialChanged;
+
+  if (version == m_stagesMaterial)
+    return;
+  m_stagesMaterial = version;
+
+  for (auto& range : m_materialRanges)
+    std::copy_n(
+        range.stage->m_materialData.get() + range.from,
+        range.size,
+        m_materialData.get() + range.to);
+  materialChanged++;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "mesh.hpp"
+#include "node.hpp"
+
+#include <QString>
+#include <QStringList>
+
+#include <optional>
+#include <vector>
+
+struct FilterNode;
+
+// What is needed from a plain GLSL filter shader to run it as one stage of
+// a fused shader. Only shaders following the structure of the default
+// filter can be analyzed: one sampler, the standard renderer_t and
+// process_t blocks, an anonymous material_t block, no preprocessor.
+struct FusionStage
+{
+  // The shader without comments, #version, interface and uniform blocks
+  QString code;
+  // Content of the material_t block
+  QString material;
+
+  QString sampler;
+  QString output;
+
+  // Identifiers declared at global scope: renamed in the fused shader
+  QStringList globals;
+
+  // The input is only sampled at the texel being rendered, thus the stage
+  // can read the color computed by the previous one instead.
+  bool pointwise{};
+
+  static std::optional<FusionStage> analyze(const QString& fragment);
+};
+
+// Fragment shader running the stages one after the other
+QString fuseStages(const std::vector<const FusionStage*>& stages);
+
+// A chain of filters rendered in a single pass.
+// Owned by the Graph, which replaces the chain with it in the render order.
+struct FusedNode : NodeModel
+{
+  explicit FusedNode(std::vector<FilterNode*> stages);
+  virtual ~FusedNode();
+
+  const Mesh& mesh() const noexcept override { return this->m_mesh; }
+  RenderedNode* createRenderer() const noexcept override;
+
+  // Whether the fused shader is baked: the node only replaces the chain
+  // once it is. Throws if the shader could not be compiled.
+  bool ready();
+
+  // Copies the materials of the stages in the fused material_t block,
+  // and their process_t block
+  void gatherMaterial() noexcept;
+
+  // The input port reads from what the input of the first stage reads:
+  // to be called when the edges change.
+  void mirrorInput() noexcept;
+
+  const std::vector<FilterNode*> stages;
+
+  struct MaterialRange
+  {
+    const FilterNode* stage{};
+    int from{};
+    int to{};
+    int size{};
+  };
+  std::vector<MaterialRange> m_materialRanges;
+  int64_t m_stagesMaterial{-1};
+  // Where the parameters depending on the texture format are
+  int m_fusionOffset{-1};
+  bool m_ready{};
+
+  const TexturedTriangle& m_mesh = TexturedTriangle::instance();
+};
@@ -1,24 +1,62 @@
 #include "graph.hpp"
 
+#include "filternode.hpp"
 #include "nodes.hpp"
 #include "renderer.hpp"
 #include "window.hpp"
 
 #include <score/tools/Debug.hpp>
 
-static void graphwalk(NodeModel* node, std::vector<NodeModel*>& list)
+#include <QDebug>
+#include <QGuiApplication>
+#include <QPointer>
+
+#include <algorithm>
+#include <unordered_set>
+
+// Depth-first post-order walk: a node is only added to the list once all
+// the nodes it reads from are in it, even if it can be reached through
+// several paths.
+static void topologicalWalk(
+    NodeModel* node,
+    std::vector<NodeModel*>& list,
+    std::unordered_set<NodeModel*>& visited)
 {
-  for (auto inputs : node->input)
-  {
-    for (auto edge : inputs->edges)
-    {
-      if (!edge->source->node->addedToGraph)
-      {
-        list.push_back(edge->source->node);
-        edge->source->node->addedToGraph = true;
-      }
-    }
-  }
+  if (!visited.insert(node).second)
+    return;
+
+  for (auto input : node->input)
+    for (auto edge : input->edges)
+      topologicalWalk(edge->source->node, list, visited);
+
+  list.push_back(node);
+}
+
+// The filter whose output is only read by the given one, and which can
+// thus be computed in the same pass.
+static FilterNode* fusablePredecessor(NodeModel* node)
+{
+  auto consumer = dynamic_cast<FilterNode*>(node);
+  if (!consumer || !consumer->fusion || !consumer->fusion->pointwise)
+    return nullptr;
+
+  // The intermediate texture must have the same size and format as the
+  // output of the fused node
+  if (consumer->outputSize || consumer->outputFormat)
+    return nullptr;
+
+  auto in = consumer->input.front();
+  if (in->type != Types::Image || in->edges.size() != 1)
+    return nullptr;
+
+  auto producer = dynamic_cast<FilterNode*>(in->edges.front()->source->node);
+  if (!producer || !producer->fusion)
+    return nullptr;
+
+  if (producer->output.size() != 1 || producer->output.front()->edges.size() != 1)
+    return nullptr;
+
+  return producer;
 }
 
 void Graph::setupOutputs(GraphicsApi graphicsApi)
@@ -59,6 +97,25 @@ void Graph::setupOutputs(GraphicsApi graphicsApi)
       graphicsApi = D3D11;
 #endif
 
+  m_api = graphicsApi;
+
+  // Shaders baked from now on get the variant of this API first
+  switch (graphicsApi)
+  {
+    case OpenGL:
+      ShaderCache::instance().setActiveTarget({QShader::GlslShader, 330});
+      break;
+    case D3D11:
+      ShaderCache::instance().setActiveTarget({QShader::HlslShader, QShaderVersion(50)});
+      break;
+    case Metal:
+      ShaderCache::instance().setActiveTarget({QShader::MslShader, QShaderVersion(12)});
+      break;
+    default:
+      ShaderCache::instance().setActiveTarget({QShader::SpirvShader, 100});
+      break;
+  }
+
   for (auto output : outputs)
   {
     if (output->window)
@@ -69,17 +126,14 @@ void Graph::setupOutputs(GraphicsApi graphicsApi)
     }
   }
 
-  for (auto node : nodes)
+  for (auto& renderer : renderers)
   {
-    node->renderedNodes.clear();
+    releaseRenderer(*renderer);
   }
 
-  for (auto& renderer : renderers)
+  for (auto node : nodes)
   {
-    renderer->release();
-
-    for (auto rn : renderer->renderedNodes)
-      delete rn;
+    node->renderedNodes.clear();
   }
 
   renderers.clear();
@@ -90,174 +144,752 @@ void Graph::setupOutputs(GraphicsApi graphicsApi)
       outputs.push_back(out);
 
   renderers.reserve(std::max((int)16, (int)outputs.size()));
-  int i = 0;
   for (auto output : outputs)
   {
-    if (!output->window)
-    {
-      output->window = std::make_shared<Window>(graphicsApi);
+    createOutput(output);
+  }
+
+  m_outputsReady = true;
+}
+
+void Graph::createOutput(OutputNode* output)
+{
+  const auto graphicsApi = m_api;
+  if (output->window)
+  {
+    renderers.push_back(createRenderer(output, output->window->state));
+    // output->window->state.hasSwapChain = true;
+    setupWindow(output);
+    return;
+  }
+
+  if (!renderContext)
+  {
+    output->window = std::make_shared<Window>(graphicsApi);
 
 #if QT_CONFIG(vulkan)
-      if (graphicsApi == Vulkan)
-        output->window->setVulkanInstance(&vulkanInstance);
+    if (graphicsApi == Vulkan)
+      output->window->setVulkanInstance(&vulkanInstance);
 #endif
-      output->window->onWindowReady = [=] {
-        output->window->state
-            = RenderState::create(*output->window, graphicsApi);
-
-        renderers.push_back(createRenderer(output, output->window->state));
-      };
-      output->window->onResize = [=] {
-        for(auto it = this->renderers.begin(); it != this->renderers.end(); ++it)
-        {
-          auto& renderer = **it;
-          if(renderer.state.window == output->window.get())
+    setupWindow(output);
+    output->window->resize(1280, 720);
+    output->window->show();
+    return;
+  }
+
+  // QWindows belong to the GUI thread: the window is created there, then
+  // handed back to be set up before it is shown, and rendered here.
+  if (!m_pendingWindows.insert(output).second)
+    return;
+
+  QPointer<QObject> context = renderContext;
+  const bool needsSurface = graphicsApi == OpenGL && !m_device.rhi;
+#if QT_CONFIG(vulkan)
+  QVulkanInstance* instance = graphicsApi == Vulkan ? &vulkanInstance : nullptr;
+#endif
+  QMetaObject::invokeMethod(qApp, [=] {
+    if (!context)
+      return;
+
+    // Deleted on the GUI thread, once what it rendered has been released
+    std::shared_ptr<Window> window{new Window{graphicsApi}, [](Window* w) {
+                                     w->releaseResources();
+                                     w->deleteLater();
+                                   }};
+    window->renderContext = context;
+#if QT_CONFIG(vulkan)
+    if (instance)
+      window->setVulkanInstance(instance);
+#endif
+    QOffscreenSurface* surface{};
+#ifndef QT_NO_OPENGL
+    if (needsSurface)
+      surface = QRhiGles2InitParams::newFallbackSurface();
+#endif
+
+    QMetaObject::invokeMethod(
+        context,
+        [this, output, window, surface] {
+          if (surface)
           {
-            renderer.release();
+            if (!m_fallbackSurface && !m_device.rhi)
+              m_fallbackSurface = surface;
+            else
+              surface->deleteLater();
           }
-          (*it).reset();
-          *it = createRenderer(output, output->window->state);
-        }
-      };
-      output->window->resize(1280, 720);
-      output->window->show();
+
+          // The output may have been removed in the meantime
+          if (m_pendingWindows.erase(output) == 0)
+            return;
+          output->window = window;
+          setupWindow(output);
+        },
+        Qt::QueuedConnection);
+
+    window->resize(1280, 720);
+    window->show();
+  }, Qt::QueuedConnection);
+}
+
+namespace
+{
+// Reports every few seconds the frames an output presented late since the
+// last report, if any
+struct LateFrames
+{
+  using clock = std::chrono::steady_clock;
+  clock::time_point last{};
+  int64_t frames{};
+  int64_t late{};
+
+  void check(Window& window, clock::time_point now)
+  {
+    if (now - last < std::chrono::seconds{10})
+      return;
+
+    const auto& s = window.statistics();
+    if (last != clock::time_point{} && s.late > late)
+      qDebug() << "Gfx output:" << s.late - late << "late frames out of"
+               << s.frames - frames << "- mean interval"
+               << s.meanInterval * 1000. << "ms, longest" << s.maxInterval * 1000.
+               << "ms";
+
+    last = now;
+    frames = s.frames;
+    late = s.late;
+    window.resetMaxInterval();
+  }
+};
+}
+
+void Graph::setupWindow(OutputNode* output)
+{
+  const auto graphicsApi = m_api;
+  output->window->onWindowReady = [=] {
+    // All the outputs share the same device
+    if (!m_device.rhi)
+      m_device = RenderDevice::create(
+          *output->window, graphicsApi, std::exchange(m_fallbackSurface, nullptr));
+
+    // The first output of the render thread paces it
+    output->window->waitsForVSync
+        = !renderContext || ossia::none_of(renderers, [](const auto& r) {
+            return r->state.window && r->state.window->waitsForVSync;
+          });
+    output->window->state = RenderState::create(
+        *output->window, m_device, output->window->swapChainFlags());
+
+    renderers.push_back(createRenderer(output, output->window->state));
+  };
+  output->window->onResize = [=] {
+    // Only the targets of that output and of its upstream are resized
+    if (auto r = output->window->state.renderer)
+      r->maybeRebuild();
+  };
+  output->window->onFrameStart
+      = [=, lateFrames = LateFrames{}](std::chrono::steady_clock::time_point t) mutable {
+    lateFrames.check(*output->window, t);
+    updateFusion();
+
+    // The outputs of a refresh start their frames within a fraction of it
+    const auto now = std::chrono::steady_clock::now();
+    const bool refresh
+        = now - m_lastRefresh
+          >= std::chrono::duration<double>(output->window->displayPeriod() / 2.);
+    if (refresh)
+      m_lastRefresh = now;
+
+    if (onFrameStart)
+      onFrameStart(t, refresh);
+  };
+
+  output->window->targetRate = output->targetRate;
+  output->window->latency = output->latency;
+  output->window->onRender = [=] {
+    if(auto r = output->window->state.renderer)
+      r->render();
+  };
+}
+
+void Graph::releaseRenderer(Renderer& r)
+{
+  // Another output paces the render thread
+  if (r.state.window && r.state.window->waitsForVSync && renderContext)
+  {
+    for (auto& other : renderers)
+    {
+      if (other.get() != &r && other->state.window)
+      {
+        other->state.window->setWaitsForVSync(true);
+        break;
+      }
+    }
+  }
+
+  r.release();
+
+  for (auto rn : r.renderedNodes)
+  {
+    const_cast<NodeModel&>(rn->node).renderedNodes.erase(&r);
+    delete rn;
+  }
+  r.renderedNodes.clear();
+
+  if (auto up = r.upstream)
+  {
+    up->detach(r);
+    if (up->downstream.empty())
+    {
+      const auto rhi = up->state.rhi;
+      releaseRenderer(*up);
+      m_upstreamRenderers.erase(rhi);
     }
     else
     {
-      renderers.push_back(createRenderer(output, output->window->state));
-      // output->window->state.hasSwapChain = true;
+      // Release what was only rendered for that output
+      relinkUpstream(*up);
     }
+  }
+  r.nodes.clear();
+}
 
-    output->window->onRender = [=] {
-      if(auto r = output->window->state.renderer)
-        r->render();
-    };
+void Graph::addNode(NodeModel* n)
+{
+  nodes.push_back(n);
 
-    i++;
+  // Other nodes only get rendered once an edge connects them to an output
+  if (m_outputsReady)
+  {
+    if (auto out = dynamic_cast<OutputNode*>(n))
+    {
+      outputs.push_back(out);
+      createOutput(out);
+    }
   }
 }
 
-void Graph::relinkGraph()
+void Graph::removeNode(NodeModel* n)
 {
-  for (auto& rptr : renderers)
+  if (auto it = ossia::find(nodes, n); it != nodes.end())
   {
-    auto& r = *rptr;
-    for (auto& node : nodes)
-      node->addedToGraph = false;
+    nodes.erase(it);
+  }
 
-    assert(!r.nodes.empty());
+  // Normally the chain was already broken when the edges were removed
+  if (auto it = m_fusedStages.find(n); it != m_fusedStages.end())
+  {
+    auto fused = it->second;
+    dropFused(*fused);
+    m_fused.erase(ossia::find_if(m_fused, [=](auto& f) { return f.get() == fused; }));
+  }
+  ossia::remove_erase_if(m_unfusable, [=](auto& chain) {
+    return ossia::contains(chain, n);
+  });
 
-    auto out = r.nodes.back();
-    r.nodes.clear();
-    r.nodes.push_back(out);
+  invalidateSchedules(n);
+  m_schedules.erase(n);
 
-    r.renderedNodes.clear();
+  if (auto out = dynamic_cast<OutputNode*>(n))
+  {
+    if (auto it = ossia::find(outputs, out); it != outputs.end())
+      outputs.erase(it);
+    m_pendingWindows.erase(out);
 
-    auto& model_nodes = r.nodes;
+    if (out->window)
     {
-      // In which order do we want to render stuff
-      int processed = 0;
-      while (processed != model_nodes.size())
+      for (auto it = renderers.begin(); it != renderers.end(); ++it)
       {
-        graphwalk(model_nodes[processed], model_nodes);
-        processed++;
+        if ((*it)->state.window == out->window.get())
+        {
+          releaseRenderer(**it);
+          renderers.erase(it);
+          break;
+        }
       }
-      std::reverse(model_nodes.begin(), model_nodes.end());
 
-      if (model_nodes.size() > 1)
+      out->window.reset();
+    }
+    collectSchedules();
+  }
+  else
+  {
+    // Normally the node was already unlinked from every output
+    // when its edges were removed.
+    for (auto [r, rn] : n->renderedNodes)
+    {
+      rn->release(*r);
+
+      if (auto it = ossia::find(r->renderedNodes, rn);
+          it != r->renderedNodes.end())
+        r->renderedNodes.erase(it);
+      if (auto it = ossia::find(r->nodes, n); it != r->nodes.end())
+        r->nodes.erase(it);
+
+      delete rn;
+    }
+    n->renderedNodes.clear();
+  }
+}
+
+Edge* Graph::addEdge(Port* source, Port* sink)
+{
+  auto edge = new Edge{source, sink};
+  edges.push_back(edge);
+  invalidateSchedules(sink->node);
+  return edge;
+}
+
+void Graph::removeEdge(Edge* edge)
+{
+  if (auto it = ossia::find(edges, edge); it != edges.end())
+  {
+    edges.erase(it);
+  }
+
+  // The fused node reading from the same place does not own a copy of it
+  if (auto it = m_fusedStages.find(edge->sink->node); it != m_fusedStages.end())
+  {
+    auto& mirrored = it->second->input.front()->edges;
+    mirrored.erase(std::remove(mirrored.begin(), mirrored.end(), edge), mirrored.end());
+  }
+
+  invalidateSchedules(edge->sink->node);
+  delete edge;
+}
+
+void Graph::invalidateSchedules(NodeModel* changed)
+{
+  // Only the schedules which go through the node whose inputs changed
+  // have to be recomputed
+  for (auto& [root, schedule] : m_schedules)
+  {
+    if (root == changed || ossia::contains(schedule.nodes, changed))
+      schedule.dirty = true;
+  }
+
+  for (auto& r : renderers)
+  {
+    if (ossia::contains(r->nodes, changed))
+      r->scheduleDirty = true;
+  }
+
+  for (auto& [rhi, up] : m_upstreamRenderers)
+  {
+    if (ossia::contains(up->nodes, changed))
+      up->scheduleDirty = true;
+  }
+}
+
+std::vector<NodeModel*> Graph::renderOrder(Renderer& r, NodeModel* output)
+{
+  std::vector<NodeModel*> order;
+
+  ossia::small_vector<NodeModel*, 4> sources;
+  for (auto input : output->input)
+    for (auto edge : input->edges)
+      if (!ossia::contains(sources, edge->source->node))
+        sources.push_back(edge->source->node);
+
+  if (sources.size() == 1)
+  {
+    // Outputs fed from the same node share the same schedule
+    auto root = sources.front();
+    auto& schedule = m_schedules[root];
+    if (schedule.dirty)
+    {
+      std::unordered_set<NodeModel*> visited;
+      visited.insert(output);
+      schedule.nodes.clear();
+      topologicalWalk(root, schedule.nodes, visited);
+      schedule.version = ++m_scheduleVersion;
+      schedule.dirty = false;
+    }
+
+    order = schedule.nodes;
+    r.scheduleRoot = root;
+    r.scheduleVersion = schedule.version;
+  }
+  else
+  {
+    std::unordered_set<NodeModel*> visited;
+    visited.insert(output);
+    for (auto source : sources)
+      topologicalWalk(source, order, visited);
+
+    r.scheduleRoot = nullptr;
+    r.scheduleVersion = -1;
+  }
+
+  order.push_back(output);
+  r.scheduleDirty = false;
+  return order;
+}
+
+void Graph::collectSchedules()
+{
+  std::vector<NodeModel*> unused;
+  for (auto& [root, schedule] : m_schedules)
+  {
+    if (!ossia::any_of(
+            renderers, [root = root](auto& r) { return r->scheduleRoot == root; }))
+      unused.push_back(root);
+  }
+
+  for (auto root : unused)
+    m_schedules.erase(root);
+}
+
+bool Graph::needsRelink(const Renderer& r) const noexcept
+{
+  if (r.scheduleDirty)
+    return true;
+  if (!r.scheduleRoot)
+    return false;
+
+  // Another output sharing the same upstream may already have
+  // recomputed its schedule
+  auto it = m_schedules.find(r.scheduleRoot);
+  return it == m_schedules.end() || it->second.dirty
+         || it->second.version != r.scheduleVersion;
+}
+
+void Graph::fuseChains()
+{
+  std::vector<std::vector<FilterNode*>> chains;
+  if (fuseShaders)
+  {
+    ossia::flat_map<FilterNode*, FilterNode*> next;
+    std::unordered_set<FilterNode*> hasPredecessor;
+    for (auto node : nodes)
+    {
+      if (auto producer = fusablePredecessor(node))
       {
-        for (auto node : model_nodes)
-        {
-          auto rn = node->renderedNodes[&r];
-          if (!rn)
-          {
-            rn = node->createRenderer();
-            if (node != model_nodes.back())
-            {
-              rn->createRenderTarget(r.state);
-            }
-            node->renderedNodes[&r] = rn;
-            rn->init(r);
-          }
-          else
-          {
-            rn->releaseWithoutRenderTarget(r);
-            rn->init(r);
-          }
-          SCORE_ASSERT(rn);
-          r.renderedNodes.push_back(rn);
-        }
+        auto consumer = static_cast<FilterNode*>(node);
+        next[producer] = consumer;
+        hasPredecessor.insert(consumer);
       }
-      else if (model_nodes.size() == 1)
+    }
+
+    for (auto& [first, second] : next)
+    {
+      if (hasPredecessor.count(first))
+        continue;
+
+      std::vector<FilterNode*> chain{first};
+      for (auto it = next.find(first); it != next.end(); it = next.find(it->second))
+        chain.push_back(it->second);
+
+      if (!ossia::contains(m_unfusable, chain))
+        chains.push_back(std::move(chain));
+    }
+  }
+
+  // Chains which were broken by the last changes
+  for (auto it = m_fused.begin(); it != m_fused.end();)
+  {
+    if (!ossia::contains(chains, (*it)->stages))
+    {
+      dropFused(**it);
+      it = m_fused.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  // The edges to the inputs of the chains which are still there
+  for (auto& fused : m_fused)
+    fused->mirrorInput();
+
+  for (auto& chain : chains)
+  {
+    if (ossia::any_of(m_fused, [&](auto& f) { return f->stages == chain; }))
+      continue;
+
+    // The stages are rendered separately until it is baked, see updateFusion
+    auto& fused = m_fused.emplace_back(std::make_unique<FusedNode>(chain));
+    for (auto stage : chain)
+      m_fusedStages[stage] = fused.get();
+  }
+}
+
+void Graph::updateFusion()
+{
+  bool changed = false;
+  for (auto it = m_fused.begin(); it != m_fused.end();)
+  {
+    auto& fused = **it;
+    try
+    {
+      if (fused.stages.back()->fusedInto != &fused && fused.ready())
       {
-        auto rn = model_nodes[0]->renderedNodes[&r];
-        assert(rn);
-        rn->release(r);
+        fused.stages.back()->fusedInto = &fused;
+        invalidateSchedules(fused.stages.back());
+        changed = true;
       }
+      ++it;
+    }
+    catch (...)
+    {
+      // Render the nodes separately
+      m_unfusable.push_back(fused.stages);
+      dropFused(fused);
+      it = m_fused.erase(it);
     }
-    r.state.window->canRender = r.renderedNodes.size() > 1;
   }
+
+  if (changed)
+    relinkGraph();
 }
 
-std::shared_ptr<Renderer> Graph::createRenderer(OutputNode* output, RenderState state)
+void Graph::replaceShader(NodeModel* node, const QString& fragment)
 {
-  auto ptr = std::make_shared<Renderer>();
-  for (auto& node : nodes)
-    node->addedToGraph = false;
-  Renderer& r = *ptr;
-  output->window->state.renderer = ptr.get();
-  r.state = std::move(state);
+  auto filter = dynamic_cast<FilterNode*>(node);
+  const bool wasFusable = filter && filter->fusion;
+
+  node->setFragmentShader(fragment);
+  if (!filter)
+    return;
+
+  // The chains it is part of have to be compiled again
+  bool refuse = bool(filter->fusion) != wasFusable;
+  if (auto it = m_fusedStages.find(node); it != m_fusedStages.end())
+  {
+    auto fused = it->second;
+    dropFused(*fused);
+    m_fused.erase(ossia::find_if(m_fused, [=](auto& f) { return f.get() == fused; }));
+    refuse = true;
+  }
+  auto inChain = [=](auto& chain) { return ossia::contains(chain, node); };
+  if (ossia::any_of(m_unfusable, inChain))
+  {
+    ossia::remove_erase_if(m_unfusable, inChain);
+    refuse = true;
+  }
+
+  if (refuse)
+    relinkGraph();
+}
+
+void Graph::dropFused(FusedNode& fused)
+{
+  for (auto [r, rn] : fused.renderedNodes)
+  {
+    rn->release(*r);
+    if (auto it = ossia::find(r->renderedNodes, rn); it != r->renderedNodes.end())
+      r->renderedNodes.erase(it);
+    delete rn;
+  }
+  fused.renderedNodes.clear();
+
+  for (auto stage : fused.stages)
+    m_fusedStages.erase(stage);
+  fused.stages.back()->fusedInto = nullptr;
+
+  // The stages are rendered separately again
+  invalidateSchedules(fused.stages.back());
+}
+
+std::vector<NodeModel*> Graph::compileOrder(const std::vector<NodeModel*>& order) const
+{
+  if (m_fusedStages.empty())
+    return order;
 
-  auto& model_nodes = r.nodes;
+  std::vector<NodeModel*> compiled;
+  compiled.reserve(order.size());
+  for (auto node : order)
   {
-    model_nodes.push_back(output);
+    auto it = m_fusedStages.find(node);
+    if (it == m_fusedStages.end() || !it->second->stages.back()->fusedInto)
+    {
+      compiled.push_back(node);
+    }
+    else if (node == it->second->stages.back())
+    {
+      // The fused node is rendered where the last stage was
+      compiled.push_back(it->second);
+    }
+  }
+  return compiled;
+}
+
+void Graph::applyRenderOrder(
+    Renderer& r,
+    const std::vector<NodeModel*>& schedule,
+    NodeModel* screenNode)
+{
+  const auto order = compileOrder(schedule);
+
+  // Release the nodes which are not rendered by r anymore.
+  // The ones which stay keep their pipelines and render targets.
+  for (auto rn : r.renderedNodes)
+  {
+    auto& node = const_cast<NodeModel&>(rn->node);
+    if (&node == screenNode)
+      continue;
 
-    // In which order do we want to render stuff
-    int processed = 0;
-    while (processed != model_nodes.size())
+    if (!ossia::contains(order, &node))
     {
-      graphwalk(model_nodes[processed], model_nodes);
-      processed++;
+      rn->release(r);
+      node.renderedNodes.erase(&r);
+      delete rn;
     }
-    std::reverse(model_nodes.begin(), model_nodes.end());
+  }
 
-    // Now we have the nodes in the order in which they are going to
-    // be processed
+  r.renderedNodes.clear();
+
+  for (auto node : order)
+  {
+    RenderedNode* rn{};
+    if (auto it = node->renderedNodes.find(&r);
+        it != node->renderedNodes.end())
+      rn = it->second;
 
-    // We create renderers for each of them
-    for (auto node : model_nodes)
+    if (!rn)
     {
-      r.renderedNodes.push_back(node->createRenderer());
+      rn = node->createRenderer();
+      node->renderedNodes[&r] = rn;
     }
+    SCORE_ASSERT(rn);
+    r.renderedNodes.push_back(rn);
   }
 
-  // For each, we create a render target
-  for (std::size_t i = 0; i < r.renderedNodes.size() - 1; i++)
+  // The targets are shared according to the new order
+  r.assignRenderTargets();
+
+  for (auto rn : r.renderedNodes)
   {
-    auto node = r.renderedNodes[i];
-    node->createRenderTarget(r.state);
+    if (!rn->resources())
+    {
+      // New node, or an output which had nothing to render until now
+      rn->init(r);
+    }
+    else
+    {
+      // Only nodes whose sampled textures changed get new bindings
+      rn->relinkInputs(r);
+    }
   }
+}
 
-  // Except the last one which is going to render to screen
-  r.renderedNodes.back()->setScreenRenderTarget(r.state);
+void Graph::relinkOutput(Renderer& r)
+{
+  auto out = r.nodes.back();
+  if (r.nodes.size() > 1)
+  {
+    if (r.upstream)
+      applyRenderOrder(r, {out}, out);
+    else
+      applyRenderOrder(r, r.nodes, out);
+  }
+  else
+  {
+    // Nothing to show
+    applyRenderOrder(r, {}, out);
+    if (auto it = out->renderedNodes.find(&r); it != out->renderedNodes.end())
+    {
+      it->second->release(r);
+      r.renderedNodes.push_back(it->second);
+    }
+  }
+
+  r.state.window->canRender = r.nodes.size() > 1;
+}
 
-  output->window->canRender = r.renderedNodes.size() > 1;
+void Graph::relinkUpstream(Renderer& up)
+{
+  // Union of the schedules of all the outputs, without the outputs themselves
+  std::vector<NodeModel*> order;
+  for (auto out : up.downstream)
   {
-    // Register the rendered nodes with their parents
-    for (auto rn : r.renderedNodes)
+    for (auto it = out->nodes.begin(); it + 1 < out->nodes.end(); ++it)
     {
-      const_cast<NodeModel&>(rn->node).renderedNodes[&r] = rn;
+      if (!ossia::contains(order, *it))
+        order.push_back(*it);
     }
+  }
+
+  up.nodes = order;
+  applyRenderOrder(up, order, nullptr);
+  up.scheduleDirty = false;
+}
 
-    r.init();
+void Graph::attachUpstream(Renderer& r)
+{
+  auto& up = m_upstreamRenderers[r.state.rhi];
+  if (!up)
+  {
+    up = std::make_shared<Renderer>();
+    up->state.device = r.state.device;
+    up->state.rhi = r.state.rhi;
+    up->state.renderer = up.get();
+    up->state.renderSize = r.state.swapChain->surfacePixelSize();
+    up->lastSize = up->state.renderSize;
+    up->init();
+  }
+
+  up->downstream.push_back(&r);
+  r.upstream = up.get();
+}
+
+void Graph::relinkGraph()
+{
+  fuseChains();
+
+  // First find the outputs whose upstream changed
+  std::vector<Renderer*> changed;
+  for (auto& rptr : renderers)
+  {
+    auto& r = *rptr;
+    assert(!r.nodes.empty());
+
+    if (!needsRelink(r))
+      continue;
 
-    if (model_nodes.size() > 1)
+    r.nodes = renderOrder(r, r.nodes.back());
+    changed.push_back(&r);
+  }
+
+  // The shared upstream nodes must exist before the outputs sample them
+  for (auto& [rhi, up] : m_upstreamRenderers)
+  {
+    if (up->scheduleDirty
+        || ossia::any_of(up->downstream, [&](Renderer* out) {
+             return ossia::contains(changed, out);
+           }))
     {
-      for (auto rn : r.renderedNodes)
-        rn->init(r);
+      relinkUpstream(*up);
     }
   }
 
+  for (auto r : changed)
+  {
+    relinkOutput(*r);
+  }
+
+  collectSchedules();
+}
+
+std::shared_ptr<Renderer> Graph::createRenderer(OutputNode* output, RenderState state)
+{
+  auto ptr = std::make_shared<Renderer>();
+  Renderer& r = *ptr;
+  output->window->state.renderer = ptr.get();
+  r.state = std::move(state);
+  r.init();
+
+  // In which order do we want to render stuff
+  r.nodes = renderOrder(r, output);
+
+  if (shareUpstream)
+  {
+    attachUpstream(r);
+    relinkUpstream(*r.upstream);
+  }
+
+  relinkOutput(r);
+
   return ptr;
 }
 
@@ -265,11 +897,15 @@ Graph::~Graph()
 {
   for (auto& renderer : renderers)
   {
-    renderer->release();
+    releaseRenderer(*renderer);
   }
 
   for (auto out : outputs)
   {
     out->window.reset();
   }
+
+  if (m_fallbackSurface)
+    m_fallbackSurface->deleteLater();
+  m_device.release();
 }
@@ -1,24 +1,34 @@
 #pragma once
+#include "fusion.hpp"
 #include "node.hpp"
 #include "renderer.hpp"
 
 #include <ossia/detail/algorithms.hpp>
+#include <ossia/detail/flat_set.hpp>
+
+#include <chrono>
+#include <functional>
 struct OutputNode;
 class Window;
+
+// Nodes upstream of a given node, in the order in which they are rendered
+struct RenderSchedule
+{
+  std::vector<NodeModel*> nodes;
+  int64_t version{-1};
+  bool dirty{true};
+};
+
 struct Graph
 {
   std::vector<NodeModel*> nodes;
   std::vector<Edge*> edges;
 
-  void addNode(NodeModel* n) { nodes.push_back(n); }
+  void addNode(NodeModel* n);
+  void removeNode(NodeModel* n);
 
-  void removeNode(NodeModel* n)
-  {
-    if (auto it = ossia::find(nodes, n); it != nodes.end())
-    {
-      nodes.erase(it);
-    }
-  }
+  Edge* addEdge(Port* source, Port* sink);
+  void removeEdge(Edge* edge);
 
   void maybeRebuild(Renderer& r);
 
@@ -28,14 +38,80 @@ struct Graph
 
   void relinkGraph();
 
+  // Swaps the fragment shader of a node in place: the other nodes are only
+  // affected when it has to be fused with them again.
+  void replaceShader(NodeModel* node, const QString& fragment);
+
+  // When set, the nodes upstream of the outputs which share a QRhi are
+  // rendered once per frame by a common renderer, and each output only
+  // renders its final pass.
+  bool shareUpstream{true};
+
+  // When set, chains of filters which only read their input at the texel
+  // being rendered are compiled into a single shader and rendered in one pass.
+  // Off by default: the shaders are analyzed from their source, which only
+  // works for the ones written like the default filter.
+  bool fuseShaders{false};
+
+  // Called by the outputs before each of their frames, with the time at
+  // which the frame is expected to be seen. The flag is only set for the
+  // first frame started on each display refresh, whichever output starts it.
+  std::function<void(std::chrono::steady_clock::time_point, bool)> onFrameStart;
+
+  // Object living on the thread which uses the graph, when it is not the
+  // GUI thread. The windows of the outputs are then created on the GUI
+  // thread and rendered on this one.
+  QObject* renderContext{};
+
   ~Graph();
 
 private:
+  void createOutput(OutputNode* output);
+  void setupWindow(OutputNode* output);
+  void releaseRenderer(Renderer& r);
+
+  std::vector<NodeModel*> renderOrder(Renderer& r, NodeModel* output);
+  void invalidateSchedules(NodeModel* changed);
+  void collectSchedules();
+  bool needsRelink(const Renderer& r) const noexcept;
+
+  void applyRenderOrder(
+      Renderer& r,
+      const std::vector<NodeModel*>& order,
+      NodeModel* screenNode);
+  void relinkOutput(Renderer& r);
+  void relinkUpstream(Renderer& upstream);
+  void attachUpstream(Renderer& r);
+
+  void fuseChains();
+  void dropFused(FusedNode& fused);
+  // Replaces the chains whose fused shader got baked since the last frame
+  void updateFusion();
+  std::vector<NodeModel*> compileOrder(const std::vector<NodeModel*>& order) const;
+
   std::vector<OutputNode*> outputs;
   std::vector<std::shared_ptr<Renderer>> renderers;
+  ossia::flat_map<QRhi*, std::shared_ptr<Renderer>> m_upstreamRenderers;
 
   std::vector<std::shared_ptr<Window>> unused_windows;
 
+  ossia::flat_map<NodeModel*, RenderSchedule> m_schedules;
+  int64_t m_scheduleVersion{};
+
+  std::vector<std::unique_ptr<FusedNode>> m_fused;
+  ossia::flat_map<NodeModel*, FusedNode*> m_fusedStages;
+  // Chains whose fused shader failed to compile
+  std::vector<std::vector<FilterNode*>> m_unfusable;
+
+  RenderDevice m_device;
+  // Outputs whose window is being created on the GUI thread
+  ossia::flat_set<OutputNode*> m_pendingWindows;
+  QOffscreenSurface* m_fallbackSurface{};
+  GraphicsApi m_api{};
+  bool m_outputsReady{};
+  // When the last display refresh started, see onFrameStart
+  std::chrono::steady_clock::time_point m_lastRefresh{};
+
 #if QT_CONFIG(vulkan)
   QVulkanInstance vulkanInstance;
   bool vulkanInstanceCreated{};
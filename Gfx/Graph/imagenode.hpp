@@ -121,12 +121,14 @@ struct ImagesNode : NodeModel
           res.uploadTexture(textures[i], n.images[i].image);
         }
         m_uploaded = true;
+        m_dirty = true;
       }
 
       if(prev_ubo.currentImageIndex != n.ubo.currentImageIndex)
       {
         replaceTexture(m_samplers[0].sampler, textures[n.ubo.currentImageIndex]);
         prev_ubo.currentImageIndex = n.ubo.currentImageIndex;
+        m_dirty = true;
       }
 
     }
@@ -139,13 +141,20 @@ struct ImagesNode : NodeModel
     }
 
     struct ubo prev_ubo;
-    /*
+
     std::optional<QSize> renderTargetSize() const noexcept override
     {
-      auto& decoder = *static_cast<const RGB0Node&>(node).decoder;
-      const auto w = decoder.width(), h = decoder.height();
-      return QSize{w, h};
-    }*/
+      if (auto sz = RenderedNode::renderTargetSize())
+        return sz;
+
+      // Large enough for all the images
+      QSize sz;
+      for (const auto& img : static_cast<const ImagesNode&>(node).images)
+        sz = sz.expandedTo(img.image.size());
+      if (sz.isEmpty())
+        return {};
+      return sz;
+    }
   };
 
   const TexturedTriangle& m_mesh = TexturedTriangle::instance();
@@ -159,6 +168,7 @@ struct ImagesNode : NodeModel
     output.push_back(new Port{this, {}, Types::Image, {}});
 
     m_materialData.reset((char*)&ubo);
+    m_materialSize = sizeof(ubo);
   }
   virtual ~ImagesNode() { m_materialData.release(); }
 
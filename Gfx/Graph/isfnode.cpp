@@ -1,58 +1,36 @@
 #include "isfnode.hpp"
 
+#include <ossia/detail/algorithms.hpp>
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
 namespace
 {
 
-struct input_size_vis
+// Whether the input is a member of the uniform block
+struct input_uniform_vis
 {
-  int operator()(const isf::float_input&) noexcept
-  {
-    return 4;
-  }
-
-  int operator()(const isf::long_input&) noexcept
-  {
-    return 4;
-  }
-
-  int operator()(const isf::event_input&) noexcept
-  {
-    return 4; // bool
-  }
-
-  int operator()(const isf::bool_input&) noexcept
-  {
-    return 4; // bool
-  }
-
-  int operator()(const isf::point2d_input&) noexcept
+  bool operator()(const isf::image_input&) noexcept
   {
-    return 2 * 4;
+    return false;
   }
 
-  int operator()(const isf::point3d_input&) noexcept
+  bool operator()(const isf::audio_input&) noexcept
   {
-    return 3 * 4;
+    return false;
   }
 
-  int operator()(const isf::color_input&) noexcept
+  bool operator()(const isf::audioFFT_input&) noexcept
   {
-    return 4 * 4;
+    return false;
   }
 
-  int operator()(const isf::image_input&) noexcept
+  template <typename T>
+  bool operator()(const T&) noexcept
   {
-    return 0;
-  }
-
-  int operator()(const isf::audio_input&) noexcept
-  {
-    return 0;
-  }
-
-  int operator()(const isf::audioFFT_input&)noexcept
-  {
-    return 0;
+    return true;
   }
 };
 
@@ -60,47 +38,44 @@ struct input_port_vis
 {
   ISFNode& self;
   char* data{};
+  // Offset of each member of the block
+  const int* offset{};
+
+  char* next() noexcept { return data + *offset++; }
 
   void operator()(const isf::float_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Float, {}});
-    data += 4;
+    self.input.push_back(new Port{&self, next(), Types::Float, {}});
   }
 
   void operator()(const isf::long_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Int, {}});
-    data += 4;
+    self.input.push_back(new Port{&self, next(), Types::Int, {}});
   }
 
   void operator()(const isf::event_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Int, {}});
-    data += 4;
+    self.input.push_back(new Port{&self, next(), Types::Int, {}});
   }
 
   void operator()(const isf::bool_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Int, {}});
-    data += 4;
+    self.input.push_back(new Port{&self, next(), Types::Int, {}});
   }
 
   void operator()(const isf::point2d_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Vec2, {}});
-    data += 2 * 4;
+    self.input.push_back(new Port{&self, next(), Types::Vec2, {}});
   }
 
   void operator()(const isf::point3d_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Vec3, {}});
-    data += 3 * 4;
+    self.input.push_back(new Port{&self, next(), Types::Vec3, {}});
   }
 
   void operator()(const isf::color_input&) noexcept
   {
-    self.input.push_back(new Port{&self, data, Types::Vec4, {}});
-    data += 4 * 4;
+    self.input.push_back(new Port{&self, next(), Types::Vec4, {}});
   }
 
   void operator()(const isf::image_input&) noexcept
@@ -124,6 +99,9 @@ struct input_port_vis
 }
 
 
+// The value of a WIDTH or HEIGHT which does not depend on the output size
+static std::optional<double> constantExpression(const std::string& expr);
+
 ISFNode::ISFNode(const isf::descriptor& desc, QString frag)
   : ISFNode{desc, defaultVert, frag, &TexturedTriangle::instance()}
 {
@@ -133,24 +111,66 @@ ISFNode::ISFNode(const isf::descriptor& desc, QString vert, QString frag, const
   : m_mesh{mesh}
 {
   setShaders(vert, frag);
-  int sz = 0;
 
-  int i = 0;
+  int count = 0;
   for(const isf::input& input : desc.inputs)
+    count += std::visit(input_uniform_vis{}, input.data);
+
+  // The layout of the block is the one of the shader,
+  // which declares the members in the order of the inputs.
+  std::vector<int> offsets;
+  auto& cache = ShaderCache::instance();
+  for (auto stage : {QShader::FragmentStage, QShader::VertexStage})
+  {
+    const auto d = cache.reflect(stage == QShader::FragmentStage ? frag : vert, stage);
+    for (auto& ub : d.uniformBlocks())
+    {
+      if (ub.binding != 2 || ub.members.size() != count)
+        continue;
+
+      m_materialSize = ub.size;
+      for (auto& member : ub.members)
+        offsets.push_back(member.offset);
+      break;
+    }
+    if (!offsets.empty())
+      break;
+  }
+
+  int sz = m_materialSize;
+  if (offsets.size() != std::size_t(count))
   {
-    sz += std::visit(input_size_vis{}, input.data);
-    i++;
+    // Not compiling: the values are kept, nothing is uploaded
+    offsets.clear();
+    for (int i = 0; i < count; i++)
+      offsets.push_back(16 * i);
+    sz = 16 * count;
   }
 
   m_materialData.reset(new char[sz]);
   std::fill_n(m_materialData.get(), sz, 0);
-  char* cur = m_materialData.get();
 
-  input_port_vis visitor{*this, cur};
+  input_port_vis visitor{*this, m_materialData.get(), offsets.data()};
   for(const isf::input& input : desc.inputs)
     std::visit(visitor, input.data);
 
   output.push_back(new Port{this, {}, Types::Image, {}});
+
+  passes = desc.passes;
+
+  // The last pass renders into the output of the node: a FLOAT one makes
+  // it a float texture, a constant WIDTH and HEIGHT give its size.
+  if (!passes.empty())
+  {
+    const auto& last = passes.back();
+    if (last.float_storage)
+      outputFormat = QRhiTexture::RGBA32F;
+
+    const auto w = constantExpression(last.width_expression);
+    const auto h = constantExpression(last.height_expression);
+    if (w && h && *w >= 1. && *h >= 1.)
+      outputSize = QSize(int(*w), int(*h));
+  }
 }
 
 const Mesh& ISFNode::mesh() const noexcept
@@ -159,10 +179,373 @@ const Mesh& ISFNode::mesh() const noexcept
 }
 
 
+namespace
+{
+// The WIDTH and HEIGHT of the passes, e.g. "floor($WIDTH / 2.0)".
+// Only the size of the output can be referred to.
+struct size_expression
+{
+  const std::string& str;
+  double width{};
+  double height{};
+  std::size_t pos{};
+  bool failed{};
+  // Whether the size of the output is referred to
+  bool variable{};
+
+  std::optional<double> evaluate()
+  {
+    const double v = sum();
+    skip();
+    if (failed || pos != str.size() || !std::isfinite(v))
+      return std::nullopt;
+    return v;
+  }
+
+  void skip() noexcept
+  {
+    while (pos < str.size() && std::isspace((unsigned char)str[pos]))
+      pos++;
+  }
+
+  bool accept(char c) noexcept
+  {
+    skip();
+    if (pos < str.size() && str[pos] == c)
+    {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  double sum()
+  {
+    double v = product();
+    for (;;)
+    {
+      if (accept('+'))
+        v += product();
+      else if (accept('-'))
+        v -= product();
+      else
+        return v;
+    }
+  }
+
+  double product()
+  {
+    double v = unary();
+    for (;;)
+    {
+      if (accept('*'))
+        v *= unary();
+      else if (accept('/'))
+        v /= unary();
+      else
+        return v;
+    }
+  }
+
+  double unary()
+  {
+    if (accept('-'))
+      return -unary();
+    if (accept('+'))
+      return unary();
+    return primary();
+  }
+
+  double primary()
+  {
+    if (accept('('))
+    {
+      const double v = sum();
+      failed |= !accept(')');
+      return v;
+    }
+
+    skip();
+    if (pos >= str.size())
+    {
+      failed = true;
+      return 0.;
+    }
+
+    if (std::isdigit((unsigned char)str[pos]) || str[pos] == '.')
+    {
+      const char* begin = str.c_str() + pos;
+      char* end{};
+      const double v = std::strtod(begin, &end);
+      failed |= (end == begin);
+      pos += end - begin;
+      return v;
+    }
+
+    const std::size_t begin = pos;
+    if (str[pos] == '$')
+      pos++;
+    while (pos < str.size()
+           && (std::isalnum((unsigned char)str[pos]) || str[pos] == '_'))
+      pos++;
+    const auto name = str.substr(begin, pos - begin);
+
+    if (name == "$WIDTH" || name == "$HEIGHT")
+    {
+      variable = true;
+      return name == "$WIDTH" ? width : height;
+    }
+
+    std::vector<double> args;
+    if (accept('(') && !accept(')'))
+    {
+      do
+      {
+        args.push_back(sum());
+      } while (accept(','));
+      failed |= !accept(')');
+    }
+
+    if (args.size() == 1)
+    {
+      if (name == "floor")
+        return std::floor(args[0]);
+      if (name == "ceil")
+        return std::ceil(args[0]);
+      if (name == "round")
+        return std::round(args[0]);
+      if (name == "abs")
+        return std::abs(args[0]);
+      if (name == "sqrt")
+        return std::sqrt(args[0]);
+    }
+    else if (args.size() == 2)
+    {
+      if (name == "min")
+        return std::min(args[0], args[1]);
+      if (name == "max")
+        return std::max(args[0], args[1]);
+      if (name == "pow")
+        return std::pow(args[0], args[1]);
+    }
+
+    failed = true;
+    return 0.;
+  }
+};
+}
+
+static std::optional<double> constantExpression(const std::string& expr)
+{
+  size_expression e{expr};
+  auto v = e.evaluate();
+  if (e.variable)
+    return std::nullopt;
+  return v;
+}
+
 struct RenderedISFNode : RenderedNode
 {
   using RenderedNode::RenderedNode;
 
+  // Texture written by the passes with a TARGET
+  struct PassTarget
+  {
+    const isf::pass* pass{};
+    // Index of the first pass rendering into it
+    std::size_t firstWriter{};
+
+    // Persistent targets swap their two textures on each frame: the passes
+    // read the previous frame from one and render into the other.
+    // Otherwise both are the same.
+    QRhiTexture* textures[2]{};
+    QRhiTextureRenderTarget* renderTargets[2]{};
+    QRhiRenderPassDescriptor* renderPass{};
+    QRhiSampler* sampler{};
+  };
+
+  struct Pass
+  {
+    int target{-1};
+    UniformRange processUBO{};
+    // For each parity of the frame
+    QRhiShaderResourceBindings* srb[2]{};
+    QRhiGraphicsPipeline* pipeline{};
+    QByteArray pipelineKey;
+  };
+
+  std::vector<PassTarget> m_targets;
+  std::vector<Pass> m_passes;
+  QSize m_targetsSize;
+  int m_parity{};
+  bool m_clearTargets{};
+
+  bool multiPass() const noexcept { return !m_targets.empty(); }
+
+  void setSamplerTexture(QRhiSampler* sampler, QRhiTexture* texture)
+  {
+    for (auto& s : m_samplers)
+      if (s.sampler == sampler)
+        s.texture = texture;
+    replaceTexture(sampler, texture);
+  }
+
+  QRhiTexture* textureFor(
+      Renderer& renderer,
+      const PassTarget& target,
+      std::size_t pass,
+      int parity) const noexcept
+  {
+    // Rendered earlier in the frame
+    const bool writes = m_passes[pass].target == (&target - m_targets.data());
+    if (pass > target.firstWriter && !writes)
+      return target.textures[parity];
+
+    // Otherwise, what the previous frame rendered if it was kept
+    return target.pass->persistent ? target.textures[1 - parity]
+                                   : renderer.m_emptyTexture;
+  }
+
+  void createTargets(Renderer& renderer)
+  {
+    auto& rhi = *renderer.state.rhi;
+    auto& device = *renderer.state.device;
+
+    m_targetsSize = m_renderTarget->pixelSize();
+    const auto dimension = [this](const std::string& expr, int size) {
+      if (expr.empty())
+        return size;
+      size_expression e{expr, double(m_targetsSize.width()), double(m_targetsSize.height())};
+      if (auto v = e.evaluate())
+        return std::max(1, int(*v));
+      return size;
+    };
+
+    for (auto& target : m_targets)
+    {
+      const QSize size{
+          dimension(target.pass->width_expression, m_targetsSize.width()),
+          dimension(target.pass->height_expression, m_targetsSize.height())};
+
+      auto format = QRhiTexture::RGBA8;
+      if (target.pass->float_storage)
+      {
+        if (rhi.isTextureFormatSupported(QRhiTexture::RGBA32F, QRhiTexture::RenderTarget))
+          format = QRhiTexture::RGBA32F;
+        else if (rhi.isTextureFormatSupported(QRhiTexture::RGBA16F, QRhiTexture::RenderTarget))
+          format = QRhiTexture::RGBA16F;
+      }
+
+      const int count = target.pass->persistent ? 2 : 1;
+      for (int i = 0; i < count; i++)
+      {
+        auto texture = rhi.newTexture(format, size, 1, QRhiTexture::RenderTarget);
+        ensure(texture->build());
+
+        QRhiColorAttachment color0{texture};
+        auto renderTarget = rhi.newTextureRenderTarget({color0});
+        target.renderPass = device.renderPass(*renderTarget, format);
+        ensure(target.renderPass);
+        renderTarget->setRenderPassDescriptor(target.renderPass);
+        ensure(renderTarget->build());
+
+        target.textures[i] = texture;
+        target.renderTargets[i] = renderTarget;
+      }
+
+      if (count == 1)
+      {
+        target.textures[1] = target.textures[0];
+        target.renderTargets[1] = target.renderTargets[0];
+      }
+    }
+
+    m_clearTargets = true;
+  }
+
+  void releaseTargets()
+  {
+    for (auto& target : m_targets)
+    {
+      const int count = target.pass->persistent ? 2 : 1;
+      for (int i = 0; i < count; i++)
+      {
+        // May still be used by the frame in flight
+        target.renderTargets[i]->releaseAndDestroyLater();
+        target.textures[i]->releaseAndDestroyLater();
+      }
+      for (int i = 0; i < 2; i++)
+      {
+        target.renderTargets[i] = nullptr;
+        target.textures[i] = nullptr;
+      }
+    }
+  }
+
+  // The bindings of the node, with the process_t block and the targets
+  // of each pass
+  void updatePassBindings(Renderer& renderer)
+  {
+    auto& rhi = *renderer.state.rhi;
+    const auto stages = QRhiShaderResourceBinding::VertexStage
+                        | QRhiShaderResourceBinding::FragmentStage;
+
+    for (std::size_t i = 0; i < m_passes.size(); i++)
+    {
+      auto& pass = m_passes[i];
+      for (int parity : {0, 1})
+      {
+        auto bindings = inputBindings(renderer, stages);
+        for (auto& b : bindings)
+        {
+          auto& d = *b.data();
+          if (d.binding == 1)
+          {
+            b = QRhiShaderResourceBinding::uniformBuffer(
+                1, stages, pass.processUBO.buffer, pass.processUBO.offset, pass.processUBO.size);
+          }
+          else if (d.type == QRhiShaderResourceBinding::Type::SampledTexture)
+          {
+            for (auto& target : m_targets)
+              if (d.u.stex.texSamplers[0].sampler == target.sampler)
+                d.u.stex.texSamplers[0].tex = textureFor(renderer, target, i, parity);
+          }
+        }
+
+        auto& srb = pass.srb[parity];
+        if (srb)
+          srb->release();
+        else
+          srb = rhi.newShaderResourceBindings();
+        srb->setBindings(bindings.begin(), bindings.end());
+        ensure(srb->build());
+      }
+    }
+  }
+
+  // The last pass renders the output with the pipeline of the node
+  void acquirePassPipelines(Renderer& renderer)
+  {
+    for (auto& pass : m_passes)
+    {
+      if (pass.target < 0)
+        continue;
+      pass.pipeline = acquirePipeline(
+          renderer, *pass.srb[0], m_targets[pass.target].renderPass, pass.pipelineKey);
+    }
+  }
+
+  void releasePassPipelines(Renderer& renderer)
+  {
+    for (auto& pass : m_passes)
+    {
+      if (pass.pipeline)
+        renderer.state.device->releasePipeline(pass.pipelineKey);
+      pass.pipeline = nullptr;
+      pass.pipelineKey.clear();
+    }
+  }
+
   void customInit(Renderer& renderer) override
   {
     QRhi& rhi = *renderer.state.rhi;
@@ -180,6 +563,92 @@ struct RenderedISFNode : RenderedNode
         m_samplers.push_back({sampler, renderer.m_emptyTexture});
         texture.samplers[&renderer] = {sampler, nullptr};
     }
+
+    // The targets are sampled after the audio inputs, in the order
+    // in which the passes declare them.
+    m_passes.resize(n.passes.size());
+    for (std::size_t i = 0; i < n.passes.size(); i++)
+    {
+      const auto& pass = n.passes[i];
+      if (pass.target.empty())
+        continue;
+
+      auto it = ossia::find_if(m_targets, [&](const PassTarget& t) {
+        return t.pass->target == pass.target;
+      });
+      if (it == m_targets.end())
+      {
+        m_targets.push_back({&pass, i});
+        it = m_targets.end() - 1;
+      }
+      m_passes[i].target = it - m_targets.begin();
+    }
+
+    if (!multiPass())
+    {
+      m_passes.clear();
+      return;
+    }
+
+    createTargets(renderer);
+    for (auto& target : m_targets)
+    {
+      target.sampler = rhi.newSampler(
+          QRhiSampler::Linear,
+          QRhiSampler::Linear,
+          QRhiSampler::None,
+          QRhiSampler::ClampToEdge,
+          QRhiSampler::ClampToEdge);
+      ensure(target.sampler->build());
+
+      m_samplers.push_back(
+          {target.sampler, textureFor(renderer, target, m_passes.size() - 1, m_parity)});
+    }
+
+    for (auto& pass : m_passes)
+      pass.processUBO = renderer.uniforms.allocate(rhi, sizeof(ProcessUBO));
+  }
+
+  void init(Renderer& renderer) override
+  {
+    RenderedNode::init(renderer);
+
+    if (multiPass())
+    {
+      updatePassBindings(renderer);
+      acquirePassPipelines(renderer);
+    }
+  }
+
+  void relinkInputs(Renderer& renderer) override
+  {
+    RenderedNode::relinkInputs(renderer);
+    if (!multiPass())
+      return;
+
+    if (m_renderTarget->pixelSize() != m_targetsSize)
+    {
+      releaseTargets();
+      createTargets(renderer);
+      for (auto& target : m_targets)
+        setSamplerTexture(
+            target.sampler,
+            textureFor(renderer, target, m_passes.size() - 1, m_parity));
+    }
+
+    updatePassBindings(renderer);
+  }
+
+  void updatePipeline(Renderer& renderer) override
+  {
+    const auto shaders = m_pipelineShaders;
+    RenderedNode::updatePipeline(renderer);
+
+    if (multiPass() && shaders != m_pipelineShaders)
+    {
+      releasePassPipelines(renderer);
+      acquirePassPipelines(renderer);
+    }
   }
 
   void
@@ -187,6 +656,7 @@ struct RenderedISFNode : RenderedNode
   {
     QRhi& rhi = *renderer.state.rhi;
     auto& n = (ISFNode&)node;
+    bool bindingsChanged = false;
     for(auto& audio : n.audio_textures)
     {
       bool textureChanged = false;
@@ -219,7 +689,9 @@ struct RenderedISFNode : RenderedNode
 
       if(textureChanged)
       {
-        replaceTexture(rhiSampler, rhiTexture ? rhiTexture : renderer.m_emptyTexture);
+        setSamplerTexture(rhiSampler, rhiTexture ? rhiTexture : renderer.m_emptyTexture);
+        bindingsChanged = true;
+        m_dirty = true;
       }
 
       if(rhiTexture)
@@ -228,8 +700,113 @@ struct RenderedISFNode : RenderedNode
         QRhiTextureUploadEntry entry{0, 0, subdesc};
         QRhiTextureUploadDescription desc{entry};
         res.uploadTexture(rhiTexture, desc);
+        m_dirty = true;
       }
     }
+
+    if (!multiPass())
+      return;
+
+    if (bindingsChanged)
+      updatePassBindings(renderer);
+
+    for (std::size_t i = 0; i < m_passes.size(); i++)
+    {
+      ProcessUBO ubo = node.standardUBO;
+      ubo.passIndex = i;
+      renderer.uniforms.write(m_passes[i].processUBO, &ubo);
+    }
+
+    // What the persistent targets contain changes on each frame
+    if (ossia::any_of(m_targets, [](const PassTarget& t) { return t.pass->persistent; }))
+      m_dirty = true;
+  }
+
+  void drawPass(
+      QRhiCommandBuffer& cb,
+      QRhiRenderTarget* renderTarget,
+      QRhiGraphicsPipeline* pipeline,
+      QRhiShaderResourceBindings* srb,
+      QRhiResourceUpdateBatch* updateBatch)
+  {
+    cb.beginPass(renderTarget, Qt::black, {1.0f, 0}, updateBatch);
+    if (pipeline)
+    {
+      const auto sz = renderTarget->pixelSize();
+      cb.setGraphicsPipeline(pipeline);
+      cb.setShaderResources(srb);
+      cb.setViewport(QRhiViewport(0, 0, sz.width(), sz.height()));
+
+      node.mesh().setupBindings(*this->m_meshBuffer, this->m_idxBuffer, cb);
+
+      cb.draw(node.mesh().vertexCount);
+    }
+    cb.endPass();
+  }
+
+  void runPass(
+      Renderer& renderer,
+      QRhiCommandBuffer& cb,
+      QRhiResourceUpdateBatch& updateBatch) override
+  {
+    if (!multiPass())
+    {
+      RenderedNode::runPass(renderer, cb, updateBatch);
+      return;
+    }
+
+    QRhiResourceUpdateBatch* batch = &updateBatch;
+
+    // What the first frame reads from the persistent targets
+    if (m_clearTargets)
+    {
+      for (auto& target : m_targets)
+      {
+        if (!target.pass->persistent)
+          continue;
+        for (auto rt : target.renderTargets)
+        {
+          cb.beginPass(rt, Qt::transparent, {1.0f, 0}, batch);
+          cb.endPass();
+          batch = nullptr;
+        }
+      }
+      m_clearTargets = false;
+    }
+
+    for (auto& pass : m_passes)
+    {
+      if (pass.target < 0)
+        continue;
+
+      drawPass(
+          cb,
+          m_targets[pass.target].renderTargets[m_parity],
+          pass.pipeline,
+          pass.srb[m_parity],
+          batch);
+      batch = nullptr;
+    }
+
+    // The last pass renders into the output of the node: when it has a
+    // target of its own, what it rendered there is copied.
+    const auto& last = m_passes.back();
+    QRhiTexture* rendered
+        = last.target >= 0 ? m_targets[last.target].textures[m_parity] : nullptr;
+    if (rendered && m_texture && rendered->pixelSize() == m_texture->pixelSize()
+        && rendered->format() == m_texture->format())
+    {
+      auto copy = renderer.state.rhi->nextResourceUpdateBatch();
+      copy->copyTexture(m_texture, rendered);
+      cb.resourceUpdate(copy);
+    }
+    else
+    {
+      drawPass(cb, m_renderTarget, pipeline(), last.srb[m_parity], batch);
+    }
+
+    m_parity = 1 - m_parity;
+    markRendered(renderer);
   }
 
   void customRelease(Renderer& renderer) override
@@ -241,6 +818,20 @@ struct RenderedISFNode : RenderedNode
         if(tex != renderer.m_emptyTexture)
           tex->releaseAndDestroyLater();
       }
+
+    // The samplers of the targets are released with the other ones
+    releasePassPipelines(renderer);
+    for (auto& pass : m_passes)
+    {
+      delete pass.srb[0];
+      delete pass.srb[1];
+      renderer.uniforms.free(pass.processUBO);
+    }
+    m_passes.clear();
+
+    releaseTargets();
+    m_targets.clear();
+    m_parity = 0;
   }
 };
 
@@ -4,6 +4,7 @@
 #include "renderer.hpp"
 #include <isf.hpp>
 #include <list>
+#include <vector>
 
 struct ISFNode : NodeModel
 {
@@ -30,6 +31,11 @@ void main(void) {
   // Texture format: 1 row = 1 channel of N samples
   std::list<AudioTexture> audio_textures;
 
+  // The shader is drawn once per pass, the last one renders the output.
+  // The passes with a target render into a texture sampled by the next
+  // ones, and by the next frame when it is persistent.
+  std::vector<isf::pass> passes;
+
 private:
   const Mesh* m_mesh{};
 };
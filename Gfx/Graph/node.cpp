@@ -3,30 +3,200 @@
 #include "graph.hpp"
 #include "mesh.hpp"
 #include "renderer.hpp"
+#include "shadercache.hpp"
+
+#include <QCryptographicHash>
+
+#include <cstring>
 
 NodeModel::NodeModel() {}
 
-void RenderedNode::createRenderTarget(const RenderState& state)
+RenderedNode* RenderedNode::sourceForInput(Renderer& renderer, const Port& in)
 {
-  auto sz = state.swapChain->surfacePixelSize();
-  if(auto true_sz = renderTargetSize())
+  if (!in.edges.empty())
   {
-    sz = *true_sz;
+    auto source_node = in.edges[0]->source->node;
+    if (source_node->fusedInto)
+      source_node = source_node->fusedInto;
+    auto& rendered = source_node->renderedNodes;
+
+    // The source may be rendered by the upstream renderer shared by
+    // several outputs
+    auto it = rendered.find(&renderer);
+    if (it == rendered.end() && renderer.upstream)
+      it = rendered.find(renderer.upstream);
+
+    if (it != rendered.end())
+      return it->second;
   }
+  return nullptr;
+}
 
-  m_texture = state.rhi->newTexture(
-      QRhiTexture::RGBA8, sz, 1, QRhiTexture::RenderTarget);
-  m_texture->build();
+static QRhiTexture* textureForInput(Renderer& renderer, const Port& in)
+{
+  if (auto source_rd = RenderedNode::sourceForInput(renderer, in))
+    if (auto tex = source_rd->m_texture)
+      return tex;
+  return renderer.m_emptyTexture;
+}
 
-  QRhiColorAttachment color0{m_texture};
+// Versions only ever increase, thus the sum changes as soon as
+// one of the inputs was rendered again.
+static int64_t inputsVersion(Renderer& renderer, const NodeModel& node)
+{
+  int64_t v = 0;
+  for (auto in : node.input)
+    if (in->type == Types::Image || in->type == Types::Buffer)
+      if (auto source_rd = RenderedNode::sourceForInput(renderer, *in))
+        v += source_rd->version;
+  return v;
+}
 
-  auto renderTarget = state.rhi->newTextureRenderTarget({color0});
-  m_renderPass = renderTarget->newCompatibleRenderPassDescriptor();
-  ensure(m_renderPass);
-  renderTarget->setRenderPassDescriptor(m_renderPass);
-  ensure(renderTarget->build());
+// Bytes written through a port of the given type
+static int uniformSize(Types type) noexcept
+{
+  switch (type)
+  {
+    case Types::Int:
+    case Types::Float:
+      return 4;
+    case Types::Vec2:
+      return 8;
+    case Types::Vec3:
+      return 12;
+    case Types::Vec4:
+      return 16;
+    case Types::Camera:
+      return sizeof(ModelCameraUBO);
+    default:
+      return 0;
+  }
+}
 
-  this->m_renderTarget = renderTarget;
+// The reflection data only tells which blocks are declared:
+// look in the SPIR-V for the instructions which read from the one
+// at the given binding. Returns a bit per member read, all of them when
+// the block is used as a whole or with an index which is not constant.
+uint32_t NodeModel::spirvMembersRead(const QShader& shader, int binding)
+{
+  const uint32_t all = ~uint32_t{};
+  const QByteArray spirv
+      = shader.shader(QShaderKey{QShader::SpirvShader, QShaderVersion(100)})
+            .shader();
+  const auto words = reinterpret_cast<const uint32_t*>(spirv.constData());
+  const int count = spirv.size() / 4;
+  if (count <= 5)
+    return all;
+
+  enum Op : uint32_t
+  {
+    OpConstant = 43,
+    OpFunctionCall = 57,
+    OpLoad = 61,
+    OpCopyMemory = 63,
+    OpAccessChain = 65,
+    OpInBoundsAccessChain = 66,
+    OpPtrAccessChain = 67,
+    OpInBoundsPtrAccessChain = 70,
+    OpDecorate = 71,
+  };
+  const uint32_t DecorationBinding = 33;
+
+  ossia::small_vector<uint32_t, 2> variables;
+  ossia::flat_map<uint32_t, uint32_t> constants;
+  for (int i = 5; i < count;)
+  {
+    const uint32_t op = words[i] & 0xFFFF;
+    const uint32_t len = words[i] >> 16;
+    if (len == 0 || i + int(len) > count)
+      return all;
+
+    if (op == OpDecorate && len >= 4 && words[i + 2] == DecorationBinding
+        && int(words[i + 3]) == binding)
+      variables.push_back(words[i + 1]);
+    else if (op == OpConstant && len == 4)
+      constants[words[i + 2]] = words[i + 3];
+    i += len;
+  }
+
+  if (variables.empty())
+    return 0;
+
+  // The index of the member of the block selected by an access chain
+  auto member = [&](uint32_t id) -> uint32_t {
+    auto it = constants.find(id);
+    if (it == constants.end() || it->second >= 32)
+      return all;
+    return 1u << it->second;
+  };
+
+  uint32_t read = 0;
+  for (int i = 5; i < count;)
+  {
+    const uint32_t op = words[i] & 0xFFFF;
+    const uint32_t len = words[i] >> 16;
+    switch (op)
+    {
+      case OpLoad:
+        if (len >= 4 && ossia::contains(variables, words[i + 3]))
+          return all;
+        break;
+      case OpAccessChain:
+      case OpInBoundsAccessChain:
+        if (len >= 4 && ossia::contains(variables, words[i + 3]))
+          read |= len >= 5 ? member(words[i + 4]) : all;
+        break;
+      case OpPtrAccessChain:
+      case OpInBoundsPtrAccessChain:
+        // The first operand after the base is the element, not the member
+        if (len >= 4 && ossia::contains(variables, words[i + 3]))
+          read |= len >= 6 ? member(words[i + 5]) : all;
+        break;
+      case OpCopyMemory:
+        if (len >= 3 && ossia::contains(variables, words[i + 2]))
+          return all;
+        break;
+      case OpFunctionCall:
+        for (uint32_t arg = 4; arg < len; arg++)
+          if (ossia::contains(variables, words[i + arg]))
+            return all;
+        break;
+      default:
+        break;
+    }
+    i += len;
+  }
+  return read;
+}
+
+// Compares the members of process_t read by a shader, in their order
+// in the block
+static bool processChanged(
+    const ProcessUBO& a,
+    const ProcessUBO& b,
+    uint32_t members) noexcept
+{
+  auto differs = [&](int member, auto field) {
+    return (members & (1u << member))
+           && std::memcmp(&(a.*field), &(b.*field), sizeof(a.*field)) != 0;
+  };
+  return differs(0, &ProcessUBO::time) || differs(1, &ProcessUBO::timeDelta)
+         || differs(2, &ProcessUBO::progress)
+         || differs(3, &ProcessUBO::passIndex)
+         || differs(4, &ProcessUBO::frameIndex)
+         || differs(5, &ProcessUBO::date) || differs(6, &ProcessUBO::mouse)
+         || differs(7, &ProcessUBO::channelTime)
+         || differs(8, &ProcessUBO::sampleRate);
+}
+
+void RenderedNode::setRenderTarget(const RenderTarget& target)
+{
+  // Nothing was rendered in a new texture yet
+  if (target.texture != m_texture)
+    m_dirty = true;
+  m_texture = target.texture;
+  m_renderTarget = target.renderTarget;
+  m_renderPass = target.renderPass;
 }
 
 void RenderedNode::setScreenRenderTarget(const RenderState& state)
@@ -36,35 +206,101 @@ void RenderedNode::setScreenRenderTarget(const RenderState& state)
 }
 
 std::optional<QSize> RenderedNode::renderTargetSize() const noexcept
+{
+  return node.outputSize;
+}
+
+std::optional<QRhiTexture::Format> RenderedNode::renderTargetFormat() const noexcept
+{
+  return node.outputFormat;
+}
+
+QRhiTexture::Flags RenderedNode::renderTargetFlags() const noexcept
 {
   return {};
 }
 
 void RenderedNode::customInit(Renderer& renderer) {}
 
+int NodeModel::addShaderInputs(const QShaderDescription& d)
+{
+  int size = 0;
+  for (auto& ub : d.combinedImageSamplers())
+  {
+    input.push_back(new Port{this, {}, Types::Image, {}});
+  }
+  for (auto& ub : d.uniformBlocks())
+  {
+    if (ub.blockName != "material_t")
+      continue;
+
+    size = ub.size;
+    m_materialData.reset(new char[size]);
+    std::fill_n(m_materialData.get(), size, 0);
+
+    for (auto& u : ub.members)
+    {
+      char* cur = m_materialData.get() + u.offset;
+      switch (u.type)
+      {
+        case QShaderDescription::Int:
+          input.push_back(new Port{this, cur, Types::Int, {}});
+          break;
+        case QShaderDescription::Float:
+          input.push_back(new Port{this, cur, Types::Float, {}});
+          break;
+        case QShaderDescription::Int2:
+        case QShaderDescription::Vec2:
+          input.push_back(new Port{this, cur, Types::Vec2, {}});
+          break;
+        case QShaderDescription::Int3:
+        case QShaderDescription::Vec3:
+          input.push_back(new Port{this, cur, Types::Vec3, {}});
+          break;
+        case QShaderDescription::Int4:
+        case QShaderDescription::Vec4:
+          input.push_back(new Port{this, cur, Types::Vec4, {}});
+          break;
+
+        default:
+          qDebug() << "Warning ! " << u.name << "not handled ! things will go wrong !";
+          break;
+      }
+    }
+  }
+  return size;
+}
+
 void NodeModel::setShaders(QString vert, QString frag)
 {
-  QShaderBaker b;
-
-  b.setGeneratedShaders({
-      {QShader::SpirvShader, 100},
-      {QShader::GlslShader, 330},
-      {QShader::HlslShader, QShaderVersion(50)},
-      {QShader::MslShader, QShaderVersion(12)},
-  });
-  b.setGeneratedShaderVariants({QShader::Variant{},
-                                QShader::Variant{},
-                                QShader::Variant{},
-                                QShader::Variant{}});
-
-  b.setSourceString(vert.toLatin1(), QShader::VertexStage);
-  m_vertexS = b.bake();
-  qDebug() << b.errorMessage();
-
-  b.setSourceString(frag.toLatin1(), QShader::FragmentStage);
-  m_fragmentS = b.bake();
-  qDebug() << b.errorMessage();
-  if(!b.errorMessage().isEmpty())
+  m_vertexSource = vert;
+  auto& cache = ShaderCache::instance();
+  m_pendingVertex = cache.getAsync(vert, QShader::VertexStage);
+  m_pendingFragment = cache.getAsync(frag, QShader::FragmentStage);
+
+  // Most of the time they come from the cache
+  updateShaders(nullptr);
+}
+
+void NodeModel::setFragmentShader(QString frag)
+{
+  // The previous shaders are rendered until the new ones are baked
+  setShaders(m_vertexSource, std::move(frag));
+}
+
+void NodeModel::bakeShaders(QString vert, QString frag)
+{
+  m_vertexSource = vert;
+  auto& cache = ShaderCache::instance();
+  const auto& targets = ShaderCache::rhiTargets();
+  QString error;
+
+  m_vertexS = cache.get(vert, QShader::VertexStage, targets, error);
+  qDebug() << error;
+
+  m_fragmentS = cache.get(frag, QShader::FragmentStage, targets, error);
+  qDebug() << error;
+  if(!error.isEmpty())
   {
     qDebug() << frag.toStdString().data();
   }
@@ -73,162 +309,343 @@ void NodeModel::setShaders(QString vert, QString frag)
     throw std::runtime_error("invalid vertex shader");
   if(!m_fragmentS.isValid())
     throw std::runtime_error("invalid fragment shader");
+
+  m_processMembersRead
+      = spirvMembersRead(m_vertexS, 1) | spirvMembersRead(m_fragmentS, 1);
+  shadersVersion++;
 }
 
-void RenderedNode::init(Renderer& renderer)
+void NodeModel::updateShaders(const QRhi* rhi)
 {
-  auto& rhi = *renderer.state.rhi;
+  if (!m_pendingVertex || !m_pendingFragment)
+    return;
 
-  auto& input = node.input;
+  auto vertex = ShaderCache::result(*m_pendingVertex, rhi);
+  auto fragment = ShaderCache::result(*m_pendingFragment, rhi);
+  if (!vertex || !fragment)
+    return;
 
-  const auto& mesh = node.mesh();
-  if (!m_meshBuffer)
+  if (vertex->isValid() && fragment->isValid())
   {
-    auto [mbuffer,ibuffer] = renderer.initMeshBuffer(mesh);
-    m_meshBuffer = mbuffer;
-    m_idxBuffer = ibuffer;
+    m_vertexS = *vertex;
+    m_fragmentS = *fragment;
+    m_processMembersRead
+        = spirvMembersRead(m_vertexS, 1) | spirvMembersRead(m_fragmentS, 1);
+    shadersVersion++;
   }
+  else
+  {
+    // The node stays a pass-through
+    qDebug() << m_pendingVertex->error;
+    qDebug() << m_pendingFragment->error;
+  }
+
+  m_pendingVertex.reset();
+  m_pendingFragment.reset();
+}
+
+namespace
+{
+// What is rendered by the nodes on the default mesh whose shaders
+// are not baked yet
+struct PassthroughShaders
+{
+  QShader vertex;
+  QShader copy;
+  QShader clear;
 
-  m_processUBO = rhi.newBuffer(
-      QRhiBuffer::Dynamic, QRhiBuffer::UniformBuffer, sizeof(ProcessUBO));
-  m_processUBO->build();
+  static const PassthroughShaders& instance()
+  {
+    static const PassthroughShaders shaders = [] {
+      static const constexpr auto copy = R"_(#version 450
+    layout(location = 0) in vec2 v_texcoord;
+    layout(location = 0) out vec4 fragColor;
+
+    layout(binding = 3) uniform sampler2D tex;
+
+    void main()
+    {
+        fragColor = texture(tex, v_texcoord);
+    }
+    )_";
+
+      static const constexpr auto clear = R"_(#version 450
+    layout(location = 0) out vec4 fragColor;
+
+    void main()
+    {
+        fragColor = vec4(0.);
+    }
+    )_";
+
+      auto& cache = ShaderCache::instance();
+      const auto& targets = ShaderCache::rhiTargets();
+      QString error;
+
+      PassthroughShaders p;
+      p.vertex = cache.get(
+          TexturedTriangle::instance().defaultVertexShader(),
+          QShader::VertexStage, targets, error);
+      p.copy = cache.get(copy, QShader::FragmentStage, targets, error);
+      p.clear = cache.get(clear, QShader::FragmentStage, targets, error);
+      return p;
+    }();
+    return shaders;
+  }
+};
+}
+
+void RenderedNode::initInputs(Renderer& renderer)
+{
+  auto& rhi = *renderer.state.rhi;
+
+  // The render target may be new
+  m_dirty = true;
+
+  auto& input = node.input;
+
+  m_processUBO = renderer.uniforms.allocate(rhi, sizeof(ProcessUBO));
 
   // Set up shader inputs
   {
-    m_materialSize = 0;
+    // As laid out by the shader
+    m_materialSize = node.m_materialSize;
     for (auto in : input)
     {
-      switch (in->type)
-      {
-        case Types::Empty:
-          break;
-        case Types::Int:
-        case Types::Float:
-          m_materialSize += 4;
-          break;
-        case Types::Vec2:
-          m_materialSize += 8;
-          if(m_materialSize % 8 != 0)
-            m_materialSize += 4;
-          break;
-        case Types::Vec3:
-          m_materialSize += 12;
-          break;
-        case Types::Vec4:
-          m_materialSize += 16;
-          break;
-        case Types::Image:
-        {
-          auto sampler = rhi.newSampler(
-              QRhiSampler::Linear,
-              QRhiSampler::Linear,
-              QRhiSampler::None,
-              QRhiSampler::ClampToEdge,
-              QRhiSampler::ClampToEdge);
-          ensure(sampler->build());
-
-          QRhiTexture* texture = renderer.m_emptyTexture;
-          if (!in->edges.empty())
-            if (auto source_node = in->edges[0]->source->node)
-              if (auto source_rd = source_node->renderedNodes[&renderer])
-                if (auto tex = source_rd->m_texture)
-                  texture = tex;
-
-          m_samplers.push_back({sampler, texture});
-          break;
-        }
-        case Types::Audio:
-          break;
-        case Types::Camera:
-          m_materialSize += sizeof(ModelCameraUBO);
-          break;
-      }
+      if (in->type != Types::Image)
+        continue;
+
+      auto sampler = rhi.newSampler(
+          QRhiSampler::Linear,
+          QRhiSampler::Linear,
+          QRhiSampler::None,
+          QRhiSampler::ClampToEdge,
+          QRhiSampler::ClampToEdge);
+      ensure(sampler->build());
+
+      m_samplers.push_back({sampler, textureForInput(renderer, *in)});
     }
 
     if (m_materialSize > 0)
-    {
-      m_materialUBO = rhi.newBuffer(
-          QRhiBuffer::Dynamic, QRhiBuffer::UniformBuffer, m_materialSize);
-      ensure(m_materialUBO->build());
-    }
+      m_materialUBO = renderer.uniforms.allocate(rhi, m_materialSize);
   }
+}
+
+QVector<QRhiShaderResourceBinding> RenderedNode::inputBindings(
+    Renderer& renderer,
+    QRhiShaderResourceBinding::StageFlags bindingStages)
+{
+  QVector<QRhiShaderResourceBinding> bindings;
 
-  customInit(renderer);
-  // Build the pipeline
   {
-    m_ps = rhi.newGraphicsPipeline();
-    ensure(m_ps);
+    const auto rendererBinding = QRhiShaderResourceBinding::uniformBuffer(
+        0, bindingStages, renderer.m_rendererUBO);
+    bindings.push_back(rendererBinding);
+  }
 
-    QRhiGraphicsPipeline::TargetBlend premulAlphaBlend;
-    premulAlphaBlend.enable = true;
-    m_ps->setTargetBlends({premulAlphaBlend});
+  {
+    const auto standardUniformBinding
+        = QRhiShaderResourceBinding::uniformBuffer(
+            1, bindingStages, m_processUBO.buffer, m_processUBO.offset, m_processUBO.size);
+    bindings.push_back(standardUniformBinding);
+  }
 
-    m_ps->setSampleCount(1);
+  // Bind materials
+  if (m_materialUBO)
+  {
+    const auto materialBinding = QRhiShaderResourceBinding::uniformBuffer(
+        2, bindingStages, m_materialUBO.buffer, m_materialUBO.offset, m_materialUBO.size);
+    bindings.push_back(materialBinding);
+  }
 
-    m_ps->setDepthTest(false);
-    m_ps->setDepthWrite(false);
-    // m_ps->setCullMode(QRhiGraphicsPipeline::CullMode::Back);
-    // m_ps->setFrontFace(QRhiGraphicsPipeline::FrontFace::CCW);
+  // Bind samplers
+  int binding = 3;
+  for (auto sampler : this->m_samplers)
+  {
+    assert(sampler.texture);
+    bindings.push_back(QRhiShaderResourceBinding::sampledTexture(
+        binding,
+        bindingStages,
+        sampler.texture,
+        sampler.sampler));
+    binding++;
+  }
+  return bindings;
+}
 
-    m_ps->setShaderStages({{QRhiShaderStage::Vertex, node.m_vertexS},
-                           {QRhiShaderStage::Fragment, node.m_fragmentS}});
+void RenderedNode::init(Renderer& renderer)
+{
+  auto& rhi = *renderer.state.rhi;
 
-    QRhiVertexInputLayout inputLayout;
-    inputLayout.setBindings(mesh.vertexInputBindings.begin(), mesh.vertexInputBindings.end());
-    inputLayout.setAttributes(mesh.vertexAttributeBindings.begin(), mesh.vertexAttributeBindings.end());
-    m_ps->setVertexInputLayout(inputLayout);
+  const auto& mesh = node.mesh();
+  if (!m_meshBuffer)
+  {
+    auto [mbuffer,ibuffer] = renderer.initMeshBuffer(mesh);
+    m_meshBuffer = mbuffer;
+    m_idxBuffer = ibuffer;
+  }
+
+  initInputs(renderer);
 
-    // Shader resource bindings
+  customInit(renderer);
+
+  // Shader resource bindings
+  {
     m_srb = rhi.newShaderResourceBindings();
     ensure(m_srb);
 
-    QVector<QRhiShaderResourceBinding> bindings;
+    const auto bindings = inputBindings(
+        renderer,
+        QRhiShaderResourceBinding::VertexStage
+            | QRhiShaderResourceBinding::FragmentStage);
+    m_srb->setBindings(bindings.begin(), bindings.end());
+    ensure(m_srb->build());
+  }
 
-    const auto bindingStages = QRhiShaderResourceBinding::VertexStage
-                               | QRhiShaderResourceBinding::FragmentStage;
+  acquirePipeline(renderer);
+}
 
-    {
-      const auto rendererBinding = QRhiShaderResourceBinding::uniformBuffer(
-          0, bindingStages, renderer.m_rendererUBO);
-      bindings.push_back(rendererBinding);
-    }
+void RenderedNode::acquirePipeline(Renderer& renderer)
+{
+  ensure(m_renderPass);
+
+  m_pipelineShaders = node.shadersVersion;
+  m_pipelineRenderPass = m_renderPass;
+  m_ps = acquirePipeline(renderer, *m_srb, m_renderPass, m_pipelineKey);
+}
+
+QRhiGraphicsPipeline* RenderedNode::acquirePipeline(
+    Renderer& renderer,
+    QRhiShaderResourceBindings& srb,
+    QRhiRenderPassDescriptor* renderPass,
+    QByteArray& key)
+{
+  auto& device = *renderer.state.device;
+  const auto& mesh = node.mesh();
+
+  QRhiGraphicsPipeline::TargetBlend premulAlphaBlend;
+  premulAlphaBlend.enable = true;
+
+  key.clear();
+
+  QShader vertexS = node.m_vertexS;
+  QShader fragmentS = node.m_fragmentS;
+  if (!vertexS.isValid() || !fragmentS.isValid())
+  {
+    // Without a pipeline, the pass only clears the target
+    if (&mesh != &TexturedTriangle::instance())
+      return nullptr;
+
+    const auto& passthrough = PassthroughShaders::instance();
+    const bool hasImageInput = ossia::any_of(
+        node.input, [](Port* p) { return p->type == Types::Image; });
+    vertexS = passthrough.vertex;
+    fragmentS = hasImageInput ? passthrough.copy : passthrough.clear;
+  }
+
+  // Everything the pipeline is built from, except the resources themselves:
+  // two nodes with the same key can render with the same pipeline.
+  {
+    QCryptographicHash hash{QCryptographicHash::Sha1};
+    auto add = [&](auto value) {
+      hash.addData(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    const QShaderKey spirv{QShader::SpirvShader, QShaderVersion(100)};
+    hash.addData(vertexS.shader(spirv).shader());
+    hash.addData(fragmentS.shader(spirv).shader());
 
+    for (const auto& b : mesh.vertexInputBindings)
     {
-      const auto standardUniformBinding
-          = QRhiShaderResourceBinding::uniformBuffer(
-              1, bindingStages, m_processUBO);
-      bindings.push_back(standardUniformBinding);
+      add(b.stride());
+      add(b.classification());
+      add(b.instanceStepRate());
     }
-
-    // Bind materials
-    if (m_materialUBO)
+    for (const auto& a : mesh.vertexAttributeBindings)
     {
-      const auto materialBinding = QRhiShaderResourceBinding::uniformBuffer(
-          2, bindingStages, m_materialUBO);
-      bindings.push_back(materialBinding);
+      add(a.binding());
+      add(a.location());
+      add(a.format());
+      add(a.offset());
     }
 
-    // Bind samplers
-    int binding = 3;
-    for (auto sampler : this->m_samplers)
+    add(premulAlphaBlend.enable);
+    add(premulAlphaBlend.srcColor);
+    add(premulAlphaBlend.dstColor);
+    add(premulAlphaBlend.srcAlpha);
+    add(premulAlphaBlend.dstAlpha);
+
+    for (auto it = srb.cbeginBindings(); it != srb.cendBindings(); ++it)
     {
-      assert(sampler.texture);
-      bindings.push_back(QRhiShaderResourceBinding::sampledTexture(
-          binding,
-          QRhiShaderResourceBinding::VertexStage | QRhiShaderResourceBinding::FragmentStage,
-          sampler.texture,
-          sampler.sampler));
-      binding++;
+      const auto& b = *it->data();
+      add(b.binding);
+      add(int(b.stage));
+      add(b.type);
     }
-    m_srb->setBindings(bindings.begin(), bindings.end());
-    ensure(m_srb->build());
 
-    m_ps->setShaderResourceBindings(m_srb);
+    // Render passes are shared by all the compatible targets
+    add(renderPass);
+
+    key = hash.result();
+  }
+
+  if (auto ps = device.acquirePipeline(key))
+    return ps;
+
+  auto& rhi = *device.rhi;
+  auto ps = rhi.newGraphicsPipeline();
+  ensure(ps);
+
+  ps->setTargetBlends({premulAlphaBlend});
+
+  ps->setSampleCount(1);
+
+  ps->setDepthTest(false);
+  ps->setDepthWrite(false);
+  // ps->setCullMode(QRhiGraphicsPipeline::CullMode::Back);
+  // ps->setFrontFace(QRhiGraphicsPipeline::FrontFace::CCW);
+
+  ps->setShaderStages({{QRhiShaderStage::Vertex, vertexS},
+                       {QRhiShaderStage::Fragment, fragmentS}});
+
+  QRhiVertexInputLayout inputLayout;
+  inputLayout.setBindings(mesh.vertexInputBindings.begin(), mesh.vertexInputBindings.end());
+  inputLayout.setAttributes(mesh.vertexAttributeBindings.begin(), mesh.vertexAttributeBindings.end());
+  ps->setVertexInputLayout(inputLayout);
+
+  // The pipeline outlives the node which created it
+  auto layout = rhi.newShaderResourceBindings();
+  layout->setBindings(srb.cbeginBindings(), srb.cendBindings());
+  ensure(layout->build());
+  ps->setShaderResourceBindings(layout);
 
-    ensure(m_renderPass);
-    m_ps->setRenderPassDescriptor(this->m_renderPass);
+  ps->setRenderPassDescriptor(renderPass);
 
-    ensure(m_ps->build());
+  ensure(ps->build());
+
+  device.addPipeline(key, {ps, layout, renderPass});
+  return ps;
+}
+
+void RenderedNode::releasePipeline(Renderer& renderer)
+{
+  if (m_ps)
+  {
+    renderer.state.device->releasePipeline(m_pipelineKey);
+    m_ps = nullptr;
+    m_pipelineKey.clear();
+    m_pipelineRenderPass = nullptr;
+  }
+}
+
+void RenderedNode::updatePipeline(Renderer& renderer)
+{
+  const_cast<NodeModel&>(node).updateShaders(renderer.state.rhi);
+  if (m_pipelineShaders != node.shadersVersion)
+  {
+    releasePipeline(renderer);
+    acquirePipeline(renderer);
+    m_dirty = true;
   }
 }
 
@@ -240,19 +657,58 @@ void RenderedNode::customUpdate(
 
 void RenderedNode::update(Renderer& renderer, QRhiResourceUpdateBatch& res)
 {
-  res.updateDynamicBuffer(
-      m_processUBO, 0, sizeof(ProcessUBO), &this->node.standardUBO);
+  renderer.uniforms.write(m_processUBO, &this->node.standardUBO);
 
   if (m_materialSize > 0 && materialChangedIndex != node.materialChanged)
   {
-    char* data = node.m_materialData.get();
-    res.updateDynamicBuffer(m_materialUBO, 0, m_materialSize, data);
+    updateMaterial(renderer);
     materialChangedIndex = node.materialChanged;
   }
 
   customUpdate(renderer, res);
 }
 
+void RenderedNode::updateMaterial(Renderer& renderer)
+{
+  auto& uniforms = renderer.uniforms;
+  const char* data = node.m_materialData.get();
+  if (materialChangedIndex < 0)
+  {
+    uniforms.write(m_materialUBO, data);
+    return;
+  }
+
+  // Ranges closer than this are uploaded together: std140 leaves such gaps
+  // after vec3 and before vec2 / vec4.
+  constexpr int maxGap = 16;
+  int from = 0;
+  int to = 0;
+  for (auto in : node.input)
+  {
+    if (in->version <= materialChangedIndex || !in->value)
+      continue;
+
+    const int size = uniformSize(in->type);
+    const auto offset = static_cast<const char*>(in->value) - data;
+    if (size == 0 || offset < 0 || offset + size > m_materialSize)
+      continue;
+
+    if (to > from && offset >= from && offset <= to + maxGap)
+    {
+      to = std::max(to, int(offset) + size);
+      continue;
+    }
+
+    if (to > from)
+      uniforms.write(m_materialUBO, from, data + from, to - from);
+    from = offset;
+    to = offset + size;
+  }
+
+  if (to > from)
+    uniforms.write(m_materialUBO, from, data + from, to - from);
+}
+
 void RenderedNode::customRelease(Renderer&) {}
 
 void RenderedNode::releaseWithoutRenderTarget(Renderer& r)
@@ -266,15 +722,12 @@ void RenderedNode::releaseWithoutRenderTarget(Renderer& r)
   }
   m_samplers.clear();
 
-  delete m_processUBO;
-  m_processUBO = nullptr;
-
-  delete m_materialUBO;
-  m_materialUBO = nullptr;
+  r.uniforms.free(m_processUBO);
+  r.uniforms.free(m_materialUBO);
   m_materialSize = 0;
+  materialChangedIndex = -1;
 
-  delete m_ps;
-  m_ps = nullptr;
+  releasePipeline(r);
 
   delete m_srb;
   m_srb = nullptr;
@@ -282,13 +735,46 @@ void RenderedNode::releaseWithoutRenderTarget(Renderer& r)
   m_meshBuffer = nullptr;
 }
 
-void RenderedNode::runPass(Renderer& renderer, QRhiCommandBuffer& cb, QRhiResourceUpdateBatch& updateBatch)
+bool RenderedNode::hasChanged(Renderer& renderer) const noexcept
 {
-  update(renderer, updateBatch);
+  // Rendering to the screen has to be done on every frame
+  if (!m_texture)
+    return true;
+
+  if (m_aliased)
+  {
+    auto it = renderer.targetWriters.find(m_texture);
+    if (it == renderer.targetWriters.end() || it->second != this)
+      return true;
+  }
 
+  return contentChanged(renderer);
+}
+
+bool RenderedNode::contentChanged(Renderer& renderer) const noexcept
+{
+  if (!m_texture)
+    return true;
+
+  if (m_dirty || m_renderedMaterial != node.materialChanged)
+    return true;
+
+  if (m_renderedInputs != inputsVersion(renderer, node))
+    return true;
+
+  if (node.m_processMembersRead
+      && processChanged(m_renderedProcess, node.standardUBO, node.m_processMembersRead))
+    return true;
+
+  return false;
+}
+
+void RenderedNode::runPass(Renderer& renderer, QRhiCommandBuffer& cb, QRhiResourceUpdateBatch& updateBatch)
+{
   cb.beginPass(m_renderTarget, Qt::black, {1.0f, 0}, &updateBatch);
+  if (pipeline())
   {
-    const auto sz = renderer.state.swapChain->currentPixelSize();
+    const auto sz = m_renderTarget->pixelSize();
     cb.setGraphicsPipeline(pipeline());
     cb.setShaderResources(resources());
     cb.setViewport(QRhiViewport(0, 0, sz.width(), sz.height()));
@@ -301,6 +787,23 @@ void RenderedNode::runPass(Renderer& renderer, QRhiCommandBuffer& cb, QRhiResour
   }
 
   cb.endPass();
+
+  markRendered(renderer);
+}
+
+void RenderedNode::markRendered(Renderer& renderer)
+{
+  // Rendering again what another node overwrote does not change anything
+  // for the nodes reading it.
+  if (contentChanged(renderer))
+    version++;
+  if (m_aliased)
+    renderer.targetWriters[m_texture] = this;
+
+  m_dirty = false;
+  m_renderedMaterial = node.materialChanged;
+  m_renderedInputs = inputsVersion(renderer, node);
+  m_renderedProcess = node.standardUBO;
 }
 
 void RenderedNode::replaceTexture(QRhiSampler* sampler, QRhiTexture* newTexture)
@@ -324,19 +827,41 @@ void RenderedNode::replaceTexture(QRhiSampler* sampler, QRhiTexture* newTexture)
   m_srb->build();
 }
 
-void RenderedNode::release(Renderer& r)
+void RenderedNode::relinkInputs(Renderer& renderer)
 {
-  releaseWithoutRenderTarget(r);
-
-  if (m_texture)
+  // The samplers of the image inputs come first, in the order of the ports
+  std::size_t sampler_i = 0;
+  for (auto in : node.input)
   {
-    delete m_texture;
-    m_texture = nullptr;
+    if (in->type != Types::Image)
+      continue;
+    if (sampler_i >= m_samplers.size())
+      break;
 
-    delete m_renderPass;
-    m_renderPass = nullptr;
+    auto& sampler = m_samplers[sampler_i];
+    if (auto tex = textureForInput(renderer, *in); tex != sampler.texture)
+    {
+      replaceTexture(sampler.sampler, tex);
+      sampler.texture = tex;
+      m_dirty = true;
+    }
+    sampler_i++;
+  }
 
-    delete m_renderTarget;
-    m_renderTarget = nullptr;
+  // The format of the render target changed
+  if (m_ps && m_renderPass != m_pipelineRenderPass)
+  {
+    releasePipeline(renderer);
+    acquirePipeline(renderer);
   }
 }
+
+void RenderedNode::release(Renderer& r)
+{
+  releaseWithoutRenderTarget(r);
+
+  m_texture = nullptr;
+  m_renderTarget = nullptr;
+  m_renderPass = nullptr;
+  m_aliased = false;
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include "mesh.hpp"
 #include "renderstate.hpp"
+#include "shadercache.hpp"
 #include "uniforms.hpp"
 
 #include <ossia/detail/flat_map.hpp>
@@ -31,6 +32,10 @@ struct Port
   void* value{};
   Types type{};
   std::vector<Edge*> edges;
+
+  // NodeModel::materialChanged when the value was last written:
+  // the renderers upload the ports written since their last upload.
+  int64_t version{};
 };
 
 struct Edge
@@ -61,6 +66,16 @@ struct Sampler
   QRhiTexture* texture{};
 };
 
+// Part of a buffer of the UniformArena of a renderer
+struct UniformRange
+{
+  QRhiBuffer* buffer{};
+  int offset{};
+  int size{};
+
+  explicit operator bool() const noexcept { return buffer; }
+};
+
 #if defined(_MSC_VER)
 #pragma pack(push, 1)
 #endif
@@ -127,20 +142,68 @@ public:
 
   ossia::flat_map<Renderer*, RenderedNode*> renderedNodes;
 
+  // Resolution and format of the texture the node renders to. When not set,
+  // they are inherited from the first image input, or from the output.
+  std::optional<QSize> outputSize;
+  std::optional<QRhiTexture::Format> outputFormat;
+
+  // Set on the last node of a chain of filters rendered in a single pass:
+  // the nodes reading from it sample the output of the fused node instead.
+  NodeModel* fusedInto{};
+
   ProcessUBO standardUBO{};
 
+  // Content of the material_t block, m_materialSize bytes
+  const char* material() const noexcept { return m_materialData.get(); }
+  // Whether the shaders read anything from the process_t block
+  bool readsProcess() const noexcept { return m_processMembersRead; }
+
+  // Takes the shaders baked since the last call, if any, as long as they
+  // have the variant for the given QRhi, or all of them when it is null.
+  // Called by the renderers before rendering a frame.
+  void updateShaders(const QRhi* rhi);
+  // Incremented each time the shaders change
+  int64_t shadersVersion{};
+
+  // Swaps the fragment shader of a node being rendered, e.g. when editing it.
+  // The material_t block and the samplers must be the same as before.
+  virtual void setFragmentShader(QString frag);
+
 protected:
+  // The shaders are baked in the background: until they are ready,
+  // the node renders its first image input as is.
   void setShaders(QString vert, QString frag);
+  // Bakes them right away: throws if they cannot be compiled
+  void bakeShaders(QString vert, QString frag);
 
+  // The members of the block at the given binding read by the shader,
+  // a bit each, see m_processMembersRead
+  static uint32_t spirvMembersRead(const QShader& shader, int binding);
+
+  // An image input per sampler, then an input per member of the
+  // material_t block, at the offset given by the shader.
+  // Returns the size of the block.
+  int addShaderInputs(const QShaderDescription& d);
+
+  QString m_vertexSource;
   QShader m_vertexS;
   QShader m_fragmentS;
+  std::shared_ptr<PendingShader> m_pendingVertex;
+  std::shared_ptr<PendingShader> m_pendingFragment;
+
+  // The members of the process_t block read by the shaders, a bit each:
+  // e.g. the time going forward does not require rendering the node
+  // again if it does not read it.
+  uint32_t m_processMembersRead{~uint32_t{}};
 
   std::unique_ptr<char[]> m_materialData;
 
   friend class RenderedNode;
+  friend struct FusedNode;
 public:
   int64_t materialChanged{0};
-  bool addedToGraph{};
+  // Size of the material_t block pointed to by the ports
+  int m_materialSize{};
 };
 
 class RenderedNode
@@ -157,41 +220,107 @@ public:
 
   std::vector<Sampler> m_samplers;
 
-  // Pipeline
+  // Pipeline: owned by the RenderDevice, which shares it between the
+  // nodes with the same key.
   QRhiShaderResourceBindings* m_srb{};
   QRhiGraphicsPipeline* m_ps{};
+  QByteArray m_pipelineKey;
+  QRhiRenderPassDescriptor* m_pipelineRenderPass{};
+  int64_t m_pipelineShaders{-1};
 
   QRhiBuffer* m_meshBuffer{};
   QRhiBuffer* m_idxBuffer{};
 
-  QRhiBuffer* m_processUBO{};
+  // Allocated from the UniformArena of the renderer
+  UniformRange m_processUBO{};
 
-  QRhiBuffer* m_materialUBO{};
+  UniformRange m_materialUBO{};
   int m_materialSize{};
   int64_t materialChangedIndex{-1};
 
+  // Incremented each time the node renders into its texture
+  int64_t version{};
+
+  // Set by the nodes whose content changes outside of their inputs
+  // and uniforms, e.g. when a new video frame gets uploaded.
+  bool m_dirty{true};
+  int64_t m_renderedMaterial{-1};
+  int64_t m_renderedInputs{-1};
+  ProcessUBO m_renderedProcess{};
+
+  // Set when the render target is shared with other nodes of the renderer:
+  // its content may not survive until the next frame, see
+  // Renderer::targetWriters.
+  bool m_aliased{};
+  // Set when the node got a target of its own as it may skip its pass
+  bool m_keepsTarget{};
+
   friend struct Graph;
   friend struct Renderer;
 
-  void createRenderTarget(const RenderState& state);
+  // The render targets are owned by the RenderTargetPool of the renderer
+  void setRenderTarget(const RenderTarget& target);
   void setScreenRenderTarget(const RenderState& state);
 
+  // By default, what the model declares
   virtual std::optional<QSize> renderTargetSize() const noexcept;
+  virtual std::optional<QRhiTexture::Format> renderTargetFormat() const noexcept;
+  // Added to the flags of the texture of the render target
+  virtual QRhiTexture::Flags renderTargetFlags() const noexcept;
+
   // Render loop
   virtual void customInit(Renderer& renderer);
-  void init(Renderer& renderer);
+  virtual void init(Renderer& renderer);
+
+  // Creates the uniform buffers and the samplers of the inputs
+  void initInputs(Renderer& renderer);
+  // renderer_t, process_t, material_t then the samplers, from binding 0
+  QVector<QRhiShaderResourceBinding> inputBindings(
+      Renderer& renderer,
+      QRhiShaderResourceBinding::StageFlags stages);
 
   virtual void customUpdate(Renderer& renderer, QRhiResourceUpdateBatch& res);
   void update(Renderer& renderer, QRhiResourceUpdateBatch& res);
+  // Writes the parts of the material_t block which changed
+  void updateMaterial(Renderer& renderer);
 
   virtual void customRelease(Renderer&);
   void release(Renderer&);
   void releaseWithoutRenderTarget(Renderer&);
 
-  void runPass(Renderer&, QRhiCommandBuffer& commands, QRhiResourceUpdateBatch& updateBatch);
+  // Whether anything read by the pass changed since it last ran, or
+  // another node rendered into the same target since then:
+  // if not, the content of m_texture can be used as is.
+  bool hasChanged(Renderer& renderer) const noexcept;
+  // Whether the content rendered would differ from the last one
+  bool contentChanged(Renderer& renderer) const noexcept;
+  virtual void runPass(Renderer&, QRhiCommandBuffer& commands, QRhiResourceUpdateBatch& updateBatch);
+  // Records what the pass rendered from, for hasChanged
+  void markRendered(Renderer& renderer);
 
   void replaceTexture(QRhiSampler* sampler, QRhiTexture* newTexture);
 
+  // The node rendering what is sampled through an image input, if any
+  static RenderedNode* sourceForInput(Renderer& renderer, const Port& in);
+
+  // Called when the edges of the graph or the render targets change:
+  // rebinds the input samplers whose source texture is not the same anymore.
+  virtual void relinkInputs(Renderer& renderer);
+
+  // Gets the pipeline matching the shaders, bindings and render pass
+  // of the node from the cache of the device, or builds it.
+  void acquirePipeline(Renderer& renderer);
+  void releasePipeline(Renderer& renderer);
+  // Same, for drawing with other resources of the same layout or into
+  // other targets. Null when there is nothing to draw with the mesh.
+  QRhiGraphicsPipeline* acquirePipeline(
+      Renderer& renderer,
+      QRhiShaderResourceBindings& srb,
+      QRhiRenderPassDescriptor* renderPass,
+      QByteArray& key);
+  // Rebuilds the pipeline when the shaders of the node changed
+  virtual void updatePipeline(Renderer& renderer);
+
   QRhiGraphicsPipeline* pipeline() { return m_ps; }
   QRhiShaderResourceBindings* resources() { return m_srb; }
 };
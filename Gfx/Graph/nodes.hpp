@@ -22,6 +22,14 @@ struct OutputNode : NodeModel
 
   std::shared_ptr<Window> window{};
 
+  // Frames per second of the window, zero to follow the display
+  double targetRate{};
+
+  // Seconds between the presentation of a frame and the moment it is seen,
+  // e.g. for a projector. Negative to show the frames later, when the
+  // sound is the one which takes longer.
+  double latency{};
+
   const TexturedTriangle& m_mesh = TexturedTriangle::instance();
 protected:
   OutputNode()
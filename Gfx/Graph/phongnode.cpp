@@ -69,6 +69,7 @@ PhongNode::PhongNode(const Mesh* mesh)
 
   setShaders(mesh->defaultVertexShader(), frag);
   const int sz = sizeof(ModelCameraUBO);
+  m_materialSize = sz;
   m_materialData.reset(new char[sz]);
   std::fill_n(m_materialData.get(), sz, 0);
   char* cur = m_materialData.get();
@@ -2,32 +2,206 @@
 
 #include "mesh.hpp"
 
+#include <ossia/detail/algorithms.hpp>
+
+#include <cstring>
+
 MeshBuffers Renderer::initMeshBuffer(const Mesh& mesh)
 {
-  if(auto it = m_vertexBuffers.find(&mesh); it != m_vertexBuffers.end())
-    return it->second;
+  return state.device->initMeshBuffer(mesh);
+}
 
-  auto& rhi = *state.rhi;
-  auto mesh_buf = rhi.newBuffer(
-      QRhiBuffer::Immutable,
-      QRhiBuffer::VertexBuffer,
-      mesh.vertexArray.size() * sizeof(float));
-  mesh_buf->build();
+void RenderTargetPool::begin() noexcept
+{
+  for (auto& slot : slots)
+  {
+    slot.lastUse = -1;
+    slot.users = 0;
+  }
+}
 
-  QRhiBuffer* idx_buf{};
-  if(!mesh.indexArray.empty())
+int RenderTargetPool::acquire(
+    RenderDevice& device,
+    QSize size,
+    QRhiTexture::Format format,
+    QRhiTexture::Flags flags,
+    int firstUse,
+    int lastUse,
+    const RenderedNode* pinnedTo)
+{
+  for (std::size_t i = 0; i < slots.size(); i++)
   {
-    idx_buf = rhi.newBuffer(
-        QRhiBuffer::Immutable,
-        QRhiBuffer::IndexBuffer,
-        mesh.indexArray.size() * sizeof(unsigned int));
-    idx_buf->build();
+    auto& slot = slots[i];
+    if (slot.size != size || slot.format != format || slot.flags != flags
+        || slot.pinnedTo != pinnedTo)
+      continue;
+
+    // Free once everything which reads the previous content was rendered
+    if (pinnedTo ? slot.users == 0 : slot.lastUse < firstUse)
+    {
+      slot.lastUse = lastUse;
+      slot.users++;
+      return i;
+    }
+  }
+
+  auto& rhi = *device.rhi;
+  Slot slot{{}, size, format, flags, lastUse, 1, pinnedTo};
+  slot.target.texture
+      = rhi.newTexture(format, size, 1, QRhiTexture::RenderTarget | flags);
+  ensure(slot.target.texture->build());
+
+  QRhiColorAttachment color0{slot.target.texture};
+  auto renderTarget = rhi.newTextureRenderTarget({color0});
+
+  // Owned by the device, as the pipelines built against it
+  auto renderPass = device.renderPass(*renderTarget, format);
+  ensure(renderPass);
+  renderTarget->setRenderPassDescriptor(renderPass);
+  ensure(renderTarget->build());
+
+  slot.target.renderTarget = renderTarget;
+  slot.target.renderPass = renderPass;
+
+  slots.push_back(slot);
+  return slots.size() - 1;
+}
+
+void RenderTargetPool::end()
+{
+  for (auto it = slots.begin(); it != slots.end();)
+  {
+    if (it->users == 0)
+    {
+      // May still be used by the frame in flight
+      it->target.renderTarget->releaseAndDestroyLater();
+      it->target.texture->releaseAndDestroyLater();
+      it = slots.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
   }
+}
 
-  MeshBuffers ret{mesh_buf, idx_buf};
-  m_vertexBuffers.insert({&mesh, ret});
-  buffersToUpload.push_back({&mesh, ret});
-  return ret;
+void RenderTargetPool::release()
+{
+  for (auto& slot : slots)
+  {
+    delete slot.target.renderTarget;
+    delete slot.target.texture;
+  }
+  slots.clear();
+}
+
+UniformRange UniformArena::allocate(QRhi& rhi, int size)
+{
+  alignment = rhi.ubufAlignment();
+  const int alignedSize = (size + alignment - 1) / alignment * alignment;
+
+  for (auto& page : pages)
+  {
+    // Given back by a node which was released
+    if (auto it = ossia::find_if(
+            page.freed, [=](const UniformRange& r) { return r.size >= alignedSize; });
+        it != page.freed.end())
+    {
+      const UniformRange range{page.buffer, it->offset, size};
+      page.freed.erase(it);
+      return range;
+    }
+
+    if (page.used + alignedSize <= int(page.data.size()))
+    {
+      const UniformRange range{page.buffer, page.used, size};
+      page.used += alignedSize;
+      return range;
+    }
+  }
+
+  Page page;
+  page.data.resize(std::max(pageSize, alignedSize));
+  page.buffer = rhi.newBuffer(
+      QRhiBuffer::Dynamic, QRhiBuffer::UniformBuffer, page.data.size());
+  ensure(page.buffer->build());
+  page.used = alignedSize;
+  // Nothing was uploaded yet
+  page.dirtyTo = page.data.size();
+  pages.push_back(std::move(page));
+
+  return {pages.back().buffer, 0, size};
+}
+
+void UniformArena::free(UniformRange& range)
+{
+  if (!range)
+    return;
+
+  auto it = ossia::find_if(
+      pages, [&](const Page& p) { return p.buffer == range.buffer; });
+  if (it != pages.end())
+  {
+    // The padding up to the next range is free too
+    const int alignedSize = (range.size + alignment - 1) / alignment * alignment;
+    it->freed.push_back({range.buffer, range.offset, alignedSize});
+  }
+  range = {};
+}
+
+void UniformArena::write(
+    const UniformRange& range,
+    int offset,
+    const void* data,
+    int size)
+{
+  auto it = ossia::find_if(
+      pages, [&](const Page& p) { return p.buffer == range.buffer; });
+  if (it == pages.end())
+    return;
+
+  auto& page = *it;
+  char* dst = page.data.data() + range.offset + offset;
+  if (std::memcmp(dst, data, size) == 0)
+    return;
+  std::memcpy(dst, data, size);
+
+  const int from = range.offset + offset;
+  const int to = from + size;
+  if (page.dirtyTo > page.dirtyFrom)
+  {
+    page.dirtyFrom = std::min(page.dirtyFrom, from);
+    page.dirtyTo = std::max(page.dirtyTo, to);
+  }
+  else
+  {
+    page.dirtyFrom = from;
+    page.dirtyTo = to;
+  }
+}
+
+void UniformArena::upload(QRhiResourceUpdateBatch& res)
+{
+  for (auto& page : pages)
+  {
+    if (page.dirtyTo <= page.dirtyFrom)
+      continue;
+
+    res.updateDynamicBuffer(
+        page.buffer,
+        page.dirtyFrom,
+        page.dirtyTo - page.dirtyFrom,
+        page.data.data() + page.dirtyFrom);
+    page.dirtyFrom = 0;
+    page.dirtyTo = 0;
+  }
+}
+
+void UniformArena::release()
+{
+  for (auto& page : pages)
+    delete page.buffer;
+  pages.clear();
 }
 
 void Renderer::init()
@@ -44,9 +218,7 @@ void Renderer::init()
         QRhiBuffer::UniformBuffer, sizeof(ScreenUBO));
   m_rendererUBO->build();
 
-  m_emptyTexture = rhi.newTexture(
-      QRhiTexture::RGBA8, QSize{1, 1}, 1, QRhiTexture::Flag{});
-  m_emptyTexture->build();
+  m_emptyTexture = state.device->emptyTexture;
 }
 
 void Renderer::release()
@@ -54,18 +226,12 @@ void Renderer::release()
   for (int i = 0; i < renderedNodes.size(); i++)
     renderedNodes[i]->release(*this);
 
-  for (auto bufs : m_vertexBuffers)
-  {
-    delete bufs.second.mesh;
-    delete bufs.second.index;
-  }
-  m_vertexBuffers.clear();
-  buffersToUpload.clear();
-
   delete m_rendererUBO;
   m_rendererUBO = nullptr;
 
-  delete m_emptyTexture;
+  targets.release();
+  uniforms.release();
+
   m_emptyTexture = nullptr;
 
   ready = false;
@@ -76,48 +242,251 @@ void Renderer::maybeRebuild()
   const QSize outputSize = state.swapChain->currentPixelSize();
   if (outputSize != lastSize)
   {
-    release();
+    lastSize = outputSize;
+    resize();
+
+    if (upstream)
+      upstream->resizeUpstream();
+  }
+}
+
+void Renderer::resize()
+{
+  // Only the render targets depend on the size: pipelines, samplers,
+  // buffers and resource bindings objects are kept.
+  assignRenderTargets();
+
+  for (auto rn : renderedNodes)
+  {
+    rn->relinkInputs(*this);
+    rn->m_dirty = true;
+  }
 
-    // Now we have the nodes in the order in which they are going to
-    // be processed
+  // renderer_t.renderSize
+  ready = false;
+}
+
+void Renderer::resizeUpstream()
+{
+  // The shared targets are as large as the largest output
+  QSize sz;
+  for (auto out : downstream)
+    sz = sz.expandedTo(out->lastSize);
+
+  if (sz.isEmpty() || sz == state.renderSize)
+    return;
+
+  state.renderSize = sz;
+  lastSize = sz;
+  resize();
+
+  for (auto out : downstream)
+    for (auto rn : out->renderedNodes)
+      rn->relinkInputs(*out);
+}
 
-    // For each, we create a render target
-    for (int i = 0; i < renderedNodes.size() - 1; i++)
+void Renderer::assignRenderTargets()
+{
+  const int count = renderedNodes.size();
+  const bool toScreen = state.swapChain;
+  const auto defaultSize
+      = toScreen ? state.swapChain->surfacePixelSize() : state.renderSize;
+
+  // Index of the last node which reads the output of each node
+  std::vector<int> lastUse(count, -1);
+  std::vector<bool> pinned(count, false);
+
+  const auto indexOf = [this](RenderedNode* rn) -> int {
+    auto it = ossia::find(renderedNodes, rn);
+    return it != renderedNodes.end() ? int(it - renderedNodes.begin()) : -1;
+  };
+
+  for (int j = 0; j < count; j++)
+  {
+    for (auto in : renderedNodes[j]->node.input)
+    {
+      if (in->type != Types::Image)
+        continue;
+      if (int i = indexOf(RenderedNode::sourceForInput(*this, *in)); i >= 0)
+        lastUse[i] = std::max(lastUse[i], j);
+    }
+  }
+
+  // The outputs sharing this renderer sample it during their own frame
+  for (auto out : downstream)
+  {
+    if (out->nodes.empty())
+      continue;
+    for (auto in : out->nodes.back()->input)
     {
-      auto node = renderedNodes[i];
-      node->createRenderTarget(state);
+      if (in->type != Types::Image)
+        continue;
+      if (int i = indexOf(RenderedNode::sourceForInput(*out, *in)); i >= 0)
+        pinned[i] = true;
     }
+  }
 
-    // Except the last one which is going to render to screen
-    renderedNodes.back()->setScreenRenderTarget(state);
+  // The nodes which may keep their content across frames get a target of
+  // their own: sharing it would make them render again on each frame.
+  for (int i = 0; i < count; i++)
+  {
+    renderedNodes[i]->m_keepsTarget = !renderedNodes[i]->node.readsProcess();
+    if (renderedNodes[i]->m_keepsTarget)
+      pinned[i] = true;
+  }
 
-    init();
-    for (int i = 0; i < renderedNodes.size(); i++)
-      renderedNodes[i]->init(*this);
+  // Nodes which do not declare a size or format get the ones of their
+  // first image input: the order is topological so they are already known.
+  std::vector<QSize> sizes(count, defaultSize);
+  std::vector<QRhiTexture::Format> formats(count, QRhiTexture::RGBA8);
 
-    lastSize = outputSize;
+  targets.begin();
+  std::vector<int> slots(count, -1);
+  for (int i = 0; i < count; i++)
+  {
+    auto rn = renderedNodes[i];
+    if (toScreen && i == count - 1)
+    {
+      rn->setScreenRenderTarget(state);
+      continue;
+    }
+
+    for (auto in : rn->node.input)
+    {
+      if (in->type != Types::Image)
+        continue;
+
+      if (auto source = RenderedNode::sourceForInput(*this, *in))
+      {
+        if (int k = indexOf(source); k >= 0 && k < i)
+        {
+          sizes[i] = sizes[k];
+          formats[i] = formats[k];
+        }
+        else if (auto tex = source->m_texture)
+        {
+          // Rendered by the upstream renderer
+          sizes[i] = tex->pixelSize();
+          formats[i] = tex->format();
+        }
+      }
+      break;
+    }
+
+    if (auto sz = rn->renderTargetSize(); sz && !sz->isEmpty())
+      sizes[i] = *sz;
+    if (auto fmt = rn->renderTargetFormat())
+      formats[i] = *fmt;
+    if (formats[i] == QRhiTexture::RGBA32F
+        && !state.rhi->isTextureFormatSupported(formats[i], QRhiTexture::RenderTarget))
+      formats[i] = QRhiTexture::RGBA16F;
+    if (!state.rhi->isTextureFormatSupported(formats[i], QRhiTexture::RenderTarget))
+      formats[i] = QRhiTexture::RGBA8;
+
+    slots[i] = targets.acquire(
+        *state.device,
+        sizes[i],
+        formats[i],
+        rn->renderTargetFlags(),
+        i,
+        std::max(lastUse[i], i),
+        pinned[i] ? rn : nullptr);
   }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (slots[i] < 0)
+      continue;
+    auto& slot = targets.slots[slots[i]];
+    renderedNodes[i]->setRenderTarget(slot.target);
+    renderedNodes[i]->m_aliased = slot.users > 1;
+  }
+
+  targets.end();
+  targetWriters.clear();
 }
 
 void Renderer::render()
 {
-  if (renderedNodes.size() <= 1)
+  if (nodes.size() <= 1 || renderedNodes.empty())
     return;
   const auto commands = state.swapChain->currentFrameCommandBuffer();
 
   // Check if the viewport has changed
   maybeRebuild();
 
+  if (upstream)
+    upstream->renderUpstream(*this, *commands);
+
+  runPasses(*commands);
+}
+
+void Renderer::runPasses(QRhiCommandBuffer& commands)
+{
   auto updateBatch = state.rhi->nextResourceUpdateBatch();
   update(*updateBatch);
 
-  for (int i = 0; i < renderedNodes.size(); i++)
+  for (auto node : renderedNodes)
   {
-    renderedNodes[i]->runPass(*this, *commands, *updateBatch);
+    // Shaders baked in the background replace the pass-through
+    node->updatePipeline(*this);
 
-    if (i < renderedNodes.size() - 1)
-      updateBatch = state.rhi->nextResourceUpdateBatch();
+    // The uploads are always done: custom nodes notice there whether
+    // their content changed.
+    node->update(*this, *updateBatch);
   }
+
+  // What the nodes wrote to their uniform blocks, all at once
+  uniforms.upload(*updateBatch);
+
+  // The targets were assigned before the shaders of some nodes were baked
+  if (ossia::any_of(renderedNodes, [](RenderedNode* rn) {
+        return rn->m_texture && rn->m_keepsTarget == rn->node.readsProcess();
+      }))
+  {
+    resize();
+    for (auto out : downstream)
+      for (auto rn : out->renderedNodes)
+        rn->relinkInputs(*out);
+  }
+
+  for (auto node : renderedNodes)
+  {
+    // Nodes whose inputs and uniforms did not change keep their texture,
+    // the uploads go with the first pass which runs.
+    if (node->hasChanged(*this))
+    {
+      if (!updateBatch)
+        updateBatch = state.rhi->nextResourceUpdateBatch();
+      node->runPass(*this, commands, *updateBatch);
+      updateBatch = nullptr;
+    }
+  }
+
+  if (updateBatch)
+    commands.resourceUpdate(updateBatch);
+}
+
+void Renderer::renderUpstream(Renderer& output, QRhiCommandBuffer& commands)
+{
+  // A new frame starts when an output comes back for its next frame:
+  // until then the other outputs sample what was already rendered.
+  if (ossia::contains(m_frameOutputs, &output))
+    m_frameOutputs.clear();
+
+  if (m_frameOutputs.empty() && !renderedNodes.empty())
+    runPasses(commands);
+
+  m_frameOutputs.push_back(&output);
+}
+
+void Renderer::detach(Renderer& output)
+{
+  if (auto it = ossia::find(downstream, &output); it != downstream.end())
+    downstream.erase(it);
+  if (auto it = ossia::find(m_frameOutputs, &output); it != m_frameOutputs.end())
+    m_frameOutputs.erase(it);
+  output.upstream = nullptr;
 }
 
 void Renderer::update(QRhiResourceUpdateBatch& res)
@@ -150,15 +519,5 @@ void Renderer::update(QRhiResourceUpdateBatch& res)
 #endif
   }
 
-  if(Q_UNLIKELY(!buffersToUpload.empty()))
-  {
-    for(auto [mesh, buf]: buffersToUpload)
-    {
-      res.uploadStaticBuffer(buf.mesh, 0, buf.mesh->size(), mesh->vertexArray.data());
-      if(buf.index)
-        res.uploadStaticBuffer(buf.index, 0, buf.index->size(), mesh->indexArray.data());
-    }
-
-    buffersToUpload.clear();
-  }
+  state.device->uploadBuffers(res);
 }
@@ -20,9 +20,78 @@ struct
 #pragma pack()
 #endif
 
-struct MeshBuffers {
-  QRhiBuffer* mesh{};
-  QRhiBuffer* index{};
+// Render targets shared by the nodes of a renderer whose outputs are
+// not needed at the same time: in a chain, two targets are enough.
+struct RenderTargetPool
+{
+  struct Slot
+  {
+    RenderTarget target;
+    QSize size;
+    QRhiTexture::Format format{};
+    QRhiTexture::Flags flags{};
+
+    // Index in the render order after which the content is not read anymore
+    int lastUse{-1};
+    int users{};
+    // Targets read by other renderers are only used by a single node,
+    // and kept by it as long as possible.
+    const RenderedNode* pinnedTo{};
+  };
+
+  std::vector<Slot> slots;
+
+  // Starts a new assignment: all the slots become free
+  void begin() noexcept;
+  int acquire(
+      RenderDevice& device,
+      QSize size,
+      QRhiTexture::Format format,
+      QRhiTexture::Flags flags,
+      int firstUse,
+      int lastUse,
+      const RenderedNode* pinnedTo);
+  // Destroys the slots which were not acquired since begin()
+  void end();
+
+  void release();
+};
+
+// The uniform blocks of the nodes of a renderer, sub-allocated from
+// a few large dynamic buffers: what the nodes write during a frame goes
+// to a copy in memory, uploaded with a single update per buffer.
+struct UniformArena
+{
+  struct Page
+  {
+    QRhiBuffer* buffer{};
+    std::vector<char> data;
+    int used{};
+    std::vector<UniformRange> freed;
+
+    // What changed since the last upload
+    int dirtyFrom{};
+    int dirtyTo{};
+  };
+
+  static const constexpr int pageSize = 65536;
+
+  std::vector<Page> pages;
+  int alignment{256};
+
+  // The ranges are bound at the offsets they start from
+  UniformRange allocate(QRhi& rhi, int size);
+  void free(UniformRange& range);
+
+  // Only the bytes which differ from the current content are uploaded
+  void write(const UniformRange& range, int offset, const void* data, int size);
+  void write(const UniformRange& range, const void* data)
+  {
+    write(range, 0, data, range.size);
+  }
+
+  void upload(QRhiResourceUpdateBatch& res);
+  void release();
 };
 
 struct Renderer
@@ -30,30 +99,58 @@ struct Renderer
   std::vector<NodeModel*> nodes;
   std::vector<RenderedNode*> renderedNodes;
 
+  // Which cached schedule of the Graph the nodes come from
+  NodeModel* scheduleRoot{};
+  int64_t scheduleVersion{-1};
+  bool scheduleDirty{true};
+
   RenderState state;
   QSize lastSize{};
 
   // Mesh
-  ossia::flat_map<const Mesh*, MeshBuffers> m_vertexBuffers;
   MeshBuffers initMeshBuffer(const Mesh& mesh);
 
   // Material
   ScreenUBO screenUBO;
   QRhiBuffer* m_rendererUBO{};
 
+  // Owned by the device
   QRhiTexture* m_emptyTexture{};
 
+  RenderTargetPool targets;
+  // The node which rendered last into each target shared by several nodes
+  ossia::flat_map<QRhiTexture*, const RenderedNode*> targetWriters;
+  UniformArena uniforms;
+
   bool ready{};
 
+  // Set on the outputs whose upstream nodes are rendered by a renderer
+  // shared with other outputs.
+  Renderer* upstream{};
+  // Set on such a shared renderer: the outputs it renders for.
+  std::vector<Renderer*> downstream;
+
   void init();
   void release();
 
+  // Gives a render target to each node, from the order in which they
+  // are rendered. The last node of an output renders to the screen.
+  void assignRenderTargets();
+
   void render();
+  void renderUpstream(Renderer& output, QRhiCommandBuffer& commands);
 
   void update(QRhiResourceUpdateBatch& res);
 
   void maybeRebuild();
+  void resize();
+  void resizeUpstream();
+
+  void detach(Renderer& output);
 
 private:
-  ossia::small_vector<std::pair<const Mesh* const, MeshBuffers>, 4> buffersToUpload;
+  void runPasses(QRhiCommandBuffer& commands);
+
+  // Outputs which already got the current frame of a shared renderer
+  ossia::small_vector<Renderer*, 4> m_frameOutputs;
 };
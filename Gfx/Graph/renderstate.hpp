@@ -19,7 +19,17 @@
 #include <QtGui/private/qrhimetal_p.h>
 #endif
 
+#include "mesh.hpp"
+
+#include <ossia/detail/algorithms.hpp>
+#include <ossia/detail/flat_map.hpp>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QOffscreenSurface>
+#include <QStandardPaths>
+#include <QThread>
 #include <QWindow>
 
 struct Renderer;
@@ -33,37 +43,77 @@ enum GraphicsApi
 };
 class Window;
 class QOffscreenSurface;
-struct RenderState
+
+struct MeshBuffers {
+  QRhiBuffer* mesh{};
+  QRhiBuffer* index{};
+};
+
+struct RenderTarget
 {
-  QRhi* rhi{};
-  QRhiSwapChain* swapChain{};
-  QRhiRenderPassDescriptor* renderPassDescriptor{};
-  QRhiRenderBuffer* renderBuffer{};
-  Window* window{};
-  Renderer* renderer{};
+  QRhiTexture* texture{};
+  QRhiRenderTarget* renderTarget{};
+  QRhiRenderPassDescriptor* renderPass{};
+};
 
+// A graphics pipeline shared by the nodes whose shaders, vertex layout,
+// blending, resource layout and render pass are identical.
+struct CachedPipeline
+{
+  QRhiGraphicsPipeline* pipeline{};
+  // Only gives the layout: each node binds its own resources
+  QRhiShaderResourceBindings* layout{};
+  QRhiRenderPassDescriptor* renderPass{};
+  int users{};
+};
+
+// The QRhi shared by all the outputs of a graph, and the resources
+// which do not depend on any particular output.
+struct RenderDevice
+{
+  QRhi* rhi{};
   QOffscreenSurface* surface{};
-  bool hasSwapChain = false;
 
-  static RenderState create(QWindow& window, GraphicsApi graphicsApi)
-  {
-    RenderState state;
+  QRhiTexture* emptyTexture{};
 
-    state.window = reinterpret_cast<Window*>(&window);
+  ossia::flat_map<const Mesh*, MeshBuffers> meshBuffers;
+  ossia::small_vector<std::pair<const Mesh*, MeshBuffers>, 4> buffersToUpload;
+
+  // Render passes of the offscreen targets: the texture render targets
+  // of a given format are all compatible.
+  ossia::flat_map<QRhiTexture::Format, QRhiRenderPassDescriptor*> renderPasses;
+
+  // Pipelines are kept when unused as long as their render pass exists,
+  // so that a node added again does not have to build them again.
+  ossia::flat_map<QByteArray, CachedPipeline> pipelines;
+
+  // The window is only used by the backends which need a surface
+  // to pick their adapter or context. With OpenGL, the fallback surface
+  // has to be created on the GUI thread: when the device is created on
+  // another one, it must be given.
+  static RenderDevice create(
+      QWindow& window,
+      GraphicsApi graphicsApi,
+      QOffscreenSurface* fallbackSurface = nullptr)
+  {
+    RenderDevice device;
+    const QRhi::Flags flags = QRhi::EnablePipelineCacheDataSave;
     if (graphicsApi == Null)
     {
       QRhiNullInitParams params;
-      state.rhi = QRhi::create(QRhi::Null, &params, {});
+      device.rhi = QRhi::create(QRhi::Null, &params, flags);
     }
 
 #ifndef QT_NO_OPENGL
     if (graphicsApi == OpenGL)
     {
-      state.surface = QRhiGles2InitParams::newFallbackSurface();
+      device.surface = fallbackSurface
+                           ? fallbackSurface
+                           : QRhiGles2InitParams::newFallbackSurface();
       QRhiGles2InitParams params;
-      params.fallbackSurface = state.surface;
+      params.fallbackSurface = device.surface;
       params.window = &window;
-      state.rhi = QRhi::create(QRhi::OpenGLES2, &params, {});
+      device.rhi = QRhi::create(QRhi::OpenGLES2, &params, flags);
     }
 #endif
 
@@ -73,7 +123,7 @@ struct RenderState
       QRhiVulkanInitParams params;
       params.inst = window.vulkanInstance();
       params.window = &window;
-      state.rhi = QRhi::create(QRhi::Vulkan, &params, {});
+      device.rhi = QRhi::create(QRhi::Vulkan, &params, flags);
     }
 #endif
 
@@ -87,7 +137,7 @@ struct RenderState
       //   params.framesUntilKillingDeviceViaTdr = framesUntilTdr;
       //   params.repeatDeviceKill = true;
       // }
-      state.rhi = QRhi::create(QRhi::D3D11, &params, {});
+      device.rhi = QRhi::create(QRhi::D3D11, &params, flags);
     }
 #endif
 
@@ -95,15 +145,205 @@ struct RenderState
     if (graphicsApi == Metal)
     {
       QRhiMetalInitParams params;
-      state.rhi = QRhi::create(QRhi::Metal, &params, {});
-      if (!state.rhi)
+      device.rhi = QRhi::create(QRhi::Metal, &params, flags);
+      if (!device.rhi)
         qFatal("Failed to create METAL backend");
     }
 #endif
 
-    if (!state.rhi)
+    if (!device.rhi)
       qFatal("Failed to create RHI backend");
 
+    // Has to be set before any pipeline gets built
+    {
+      QFile cache{pipelineCachePath(*device.rhi)};
+      if (cache.open(QIODevice::ReadOnly))
+        device.rhi->setPipelineCacheData(cache.readAll());
+    }
+
+    device.emptyTexture = device.rhi->newTexture(
+        QRhiTexture::RGBA8, QSize{1, 1}, 1, QRhiTexture::Flag{});
+    device.emptyTexture->build();
+
+    return device;
+  }
+
+  // Mesh buffers are shared by all the nodes of all the outputs
+  MeshBuffers initMeshBuffer(const Mesh& mesh)
+  {
+    if(auto it = meshBuffers.find(&mesh); it != meshBuffers.end())
+      return it->second;
+
+    auto mesh_buf = rhi->newBuffer(
+        QRhiBuffer::Immutable,
+        QRhiBuffer::VertexBuffer,
+        mesh.vertexArray.size() * sizeof(float));
+    mesh_buf->build();
+
+    QRhiBuffer* idx_buf{};
+    if(!mesh.indexArray.empty())
+    {
+      idx_buf = rhi->newBuffer(
+          QRhiBuffer::Immutable,
+          QRhiBuffer::IndexBuffer,
+          mesh.indexArray.size() * sizeof(unsigned int));
+      idx_buf->build();
+    }
+
+    MeshBuffers ret{mesh_buf, idx_buf};
+    meshBuffers.insert({&mesh, ret});
+    buffersToUpload.push_back({&mesh, ret});
+    return ret;
+  }
+
+  void uploadBuffers(QRhiResourceUpdateBatch& res)
+  {
+    if(Q_UNLIKELY(!buffersToUpload.empty()))
+    {
+      for(auto [mesh, buf]: buffersToUpload)
+      {
+        res.uploadStaticBuffer(buf.mesh, 0, buf.mesh->size(), mesh->vertexArray.data());
+        if(buf.index)
+          res.uploadStaticBuffer(buf.index, 0, buf.index->size(), mesh->indexArray.data());
+      }
+
+      buffersToUpload.clear();
+    }
+  }
+
+  static QString pipelineCachePath(const QRhi& rhi)
+  {
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+           + QStringLiteral("/gfx/pipelines-%1.bin").arg(int(rhi.backend()));
+  }
+
+  // Driver data of the pipelines built in this session, reused by the next
+  void savePipelineCache()
+  {
+    const QByteArray data = rhi->pipelineCacheData();
+    if (data.isEmpty())
+      return;
+
+    const auto path = pipelineCachePath(*rhi);
+    QDir{}.mkpath(QFileInfo{path}.absolutePath());
+    QFile cache{path};
+    if (cache.open(QIODevice::WriteOnly))
+      cache.write(data);
+  }
+
+  QRhiRenderPassDescriptor*
+  renderPass(QRhiTextureRenderTarget& target, QRhiTexture::Format format)
+  {
+    auto& renderPass = renderPasses[format];
+    if (!renderPass)
+      renderPass = target.newCompatibleRenderPassDescriptor();
+    return renderPass;
+  }
+
+  QRhiGraphicsPipeline* acquirePipeline(const QByteArray& key)
+  {
+    auto it = pipelines.find(key);
+    if (it == pipelines.end())
+      return nullptr;
+    it->second.users++;
+    return it->second.pipeline;
+  }
+
+  void addPipeline(const QByteArray& key, CachedPipeline pipeline)
+  {
+    pipeline.users = 1;
+    pipelines.insert({key, pipeline});
+  }
+
+  void releasePipeline(const QByteArray& key)
+  {
+    auto it = pipelines.find(key);
+    if (it == pipelines.end())
+      return;
+
+    auto& p = it->second;
+    if (--p.users > 0)
+      return;
+
+    // The render passes of the swapchains go away with their window
+    const bool offscreen = ossia::any_of(
+        renderPasses, [&](const auto& rp) { return rp.second == p.renderPass; });
+    if (!offscreen)
+    {
+      delete p.pipeline;
+      delete p.layout;
+      pipelines.erase(it);
+    }
+  }
+
+  void release()
+  {
+    if (rhi)
+      savePipelineCache();
+
+    for (auto& [key, p] : pipelines)
+    {
+      delete p.pipeline;
+      delete p.layout;
+    }
+    pipelines.clear();
+
+    for (auto& [format, renderPass] : renderPasses)
+      delete renderPass;
+    renderPasses.clear();
+
+    for (auto bufs : meshBuffers)
+    {
+      delete bufs.second.mesh;
+      delete bufs.second.index;
+    }
+    meshBuffers.clear();
+    buffersToUpload.clear();
+
+    delete emptyTexture;
+    emptyTexture = nullptr;
+
+    delete rhi;
+    rhi = nullptr;
+
+    // Like the windows, the surface belongs to the GUI thread
+    if (surface)
+    {
+      if (surface->thread() == QThread::currentThread())
+        delete surface;
+      else
+        surface->deleteLater();
+      surface = nullptr;
+    }
+  }
+};
+
+struct RenderState
+{
+  RenderDevice* device{};
+  QRhi* rhi{};
+  QRhiSwapChain* swapChain{};
+  QRhiRenderPassDescriptor* renderPassDescriptor{};
+  QRhiRenderBuffer* renderBuffer{};
+  Window* window{};
+  Renderer* renderer{};
+
+  bool hasSwapChain = false;
+
+  // Size of the render targets of a renderer which has no swapchain
+  QSize renderSize{};
+
+  static RenderState create(
+      QWindow& window,
+      RenderDevice& device,
+      QRhiSwapChain::Flags flags = {})
+  {
+    RenderState state;
+
+    state.window = reinterpret_cast<Window*>(&window);
+    state.device = &device;
+    state.rhi = device.rhi;
+
     state.swapChain = state.rhi->newSwapChain();
 
     // state.renderBuffer = state.rhi->newRenderBuffer(
@@ -115,7 +355,7 @@ struct RenderState
     state.swapChain->setWindow(&window);
     // state.swapChain->setDepthStencil(state.renderBuffer);
     state.swapChain->setSampleCount(1);
-    state.swapChain->setFlags({});
+    state.swapChain->setFlags(flags);
     state.renderPassDescriptor
         = state.swapChain->newCompatibleRenderPassDescriptor();
     state.swapChain->setRenderPassDescriptor(state.renderPassDescriptor);
@@ -123,6 +363,7 @@ struct RenderState
     return state;
   }
 
+  // The device is owned by the graph and outlives the windows
   void release()
   {
     delete renderPassDescriptor;
@@ -134,11 +375,7 @@ struct RenderState
     delete swapChain;
     swapChain = nullptr;
 
-    delete rhi;
     rhi = nullptr;
-
-    delete surface;
-    surface = nullptr;
+    device = nullptr;
   }
 };
-
@@ -0,0 +1,252 @@
+#include "shadercache.hpp"
+
+#include <ossia/detail/algorithms.hpp>
+
+#include <QtGui/private/qrhi_p.h>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+// Changing it discards what was serialized by previous versions
+static const constexpr int shaderCacheVersion = 1;
+
+namespace
+{
+template <typename F>
+struct BakeJob final : QRunnable
+{
+  explicit BakeJob(F f) : f{std::move(f)} {}
+  void run() override { f(); }
+  F f;
+};
+}
+
+ShaderCache::ShaderCache()
+    : m_directory{
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+        + QStringLiteral("/gfx/shaders")}
+{
+  QDir{}.mkpath(m_directory);
+}
+
+ShaderCache& ShaderCache::instance()
+{
+  static ShaderCache cache;
+  return cache;
+}
+
+const ShaderCache::Targets& ShaderCache::rhiTargets(QShader::Stage stage)
+{
+  static const Targets targets{
+      {QShader::SpirvShader, 100},
+      {QShader::GlslShader, 330},
+      {QShader::HlslShader, QShaderVersion(50)},
+      {QShader::MslShader, QShaderVersion(12)},
+  };
+  static const Targets computeTargets{
+      {QShader::SpirvShader, 100},
+      {QShader::GlslShader, 430},
+      {QShader::HlslShader, QShaderVersion(50)},
+      {QShader::MslShader, QShaderVersion(12)},
+  };
+  return stage == QShader::ComputeStage ? computeTargets : targets;
+}
+
+void ShaderCache::setActiveTarget(QShaderBaker::GeneratedShader target)
+{
+  QMutexLocker lock{&m_mutex};
+  m_activeTarget = target;
+}
+
+QByteArray ShaderCache::key(
+    const QString& source,
+    QShader::Stage stage,
+    const Targets& targets)
+{
+  QCryptographicHash hash{QCryptographicHash::Sha1};
+  auto add = [&](int value) {
+    hash.addData(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+
+  add(shaderCacheVersion);
+  add(QT_VERSION);
+  add(stage);
+  for (const auto& target : targets)
+  {
+    add(target.first);
+    add(target.second.version());
+    add(int(target.second.flags()));
+  }
+  hash.addData(source.toUtf8());
+  return hash.result().toHex();
+}
+
+QString ShaderCache::path(const QByteArray& key) const
+{
+  return m_directory + QLatin1Char('/') + QString::fromLatin1(key)
+         + QStringLiteral(".qsb");
+}
+
+QShader ShaderCache::find(const QByteArray& key)
+{
+  {
+    QMutexLocker lock{&m_mutex};
+    if (auto it = m_shaders.constFind(key); it != m_shaders.constEnd())
+      return *it;
+  }
+
+  QFile file{path(key)};
+  if (file.open(QIODevice::ReadOnly))
+  {
+    auto shader = QShader::fromSerialized(file.readAll());
+    if (shader.isValid())
+    {
+      QMutexLocker lock{&m_mutex};
+      m_shaders.insert(key, shader);
+      return shader;
+    }
+  }
+  return {};
+}
+
+QShader ShaderCache::bake(
+    const QByteArray& key,
+    const QString& source,
+    QShader::Stage stage,
+    const Targets& targets,
+    QString& error,
+    bool persistent)
+{
+  QShaderBaker b;
+  b.setGeneratedShaders(targets);
+  b.setGeneratedShaderVariants({QShader::StandardShader});
+  // The same bytes as the ones hashed in the key
+  b.setSourceString(source.toUtf8(), stage);
+
+  auto shader = b.bake();
+  error = b.errorMessage();
+  if (!shader.isValid())
+    return shader;
+
+  // Not being able to write to the cache is not an error.
+  // Two jobs may bake the same shader: each writes a whole file.
+  if (persistent)
+  {
+    QSaveFile file{path(key)};
+    if (file.open(QIODevice::WriteOnly))
+    {
+      file.write(shader.serialized());
+      file.commit();
+    }
+  }
+
+  QMutexLocker lock{&m_mutex};
+  m_shaders.insert(key, shader);
+  return shader;
+}
+
+QShader ShaderCache::get(
+    const QString& source,
+    QShader::Stage stage,
+    const Targets& targets,
+    QString& error)
+{
+  error.clear();
+  const auto k = key(source, stage, targets);
+  if (auto shader = find(k); shader.isValid())
+    return shader;
+
+  return bake(k, source, stage, targets, error, true);
+}
+
+std::shared_ptr<PendingShader>
+ShaderCache::getAsync(const QString& source, QShader::Stage stage)
+{
+  auto pending = std::make_shared<PendingShader>();
+
+  const auto& targets = rhiTargets(stage);
+  const auto k = key(source, stage, targets);
+  if (auto shader = find(k); shader.isValid())
+  {
+    pending->shader = shader;
+    pending->completeShader = std::move(shader);
+    pending->ready = true;
+    pending->complete = true;
+    return pending;
+  }
+
+  Targets first{{QShader::SpirvShader, 100}};
+  {
+    QMutexLocker lock{&m_mutex};
+    if (m_activeTarget.first == QShader::GlslShader)
+      first.push_back(targets[1]);
+    else if (m_activeTarget.first != QShader::SpirvShader)
+      first.push_back(m_activeTarget);
+  }
+
+  m_pool.start(new BakeJob{[=] {
+    // Only kept in memory: the complete shader replaces it on disk
+    const auto firstKey = key(source, stage, first);
+    pending->shader = find(firstKey);
+    if (!pending->shader.isValid())
+      pending->shader = bake(firstKey, source, stage, first, pending->error, false);
+    const bool ok = pending->shader.isValid();
+    pending->ready = true;
+
+    if (ok)
+    {
+      QString error;
+      pending->completeShader = bake(k, source, stage, targets, error, true);
+    }
+    pending->complete = true;
+  }});
+
+  return pending;
+}
+
+const QShader* ShaderCache::result(const PendingShader& pending, const QRhi* rhi)
+{
+  if (pending.complete)
+    return &pending.completeShader;
+  if (!rhi || !pending.ready)
+    return nullptr;
+
+  // Baking failed
+  if (!pending.shader.isValid())
+    return &pending.shader;
+
+  QShader::Source source{};
+  switch (rhi->backend())
+  {
+    case QRhi::OpenGLES2:
+      source = QShader::GlslShader;
+      break;
+    case QRhi::D3D11:
+      source = QShader::HlslShader;
+      break;
+    case QRhi::Metal:
+      source = QShader::MslShader;
+      break;
+    default:
+      source = QShader::SpirvShader;
+      break;
+  }
+
+  // The active backend may have changed since the baking started
+  const auto keys = pending.shader.availableShaders();
+  if (ossia::any_of(keys, [=](const QShaderKey& k) { return k.source() == source; }))
+    return &pending.shader;
+  return nullptr;
+}
+
+QShaderDescription ShaderCache::reflect(const QString& source, QShader::Stage stage)
+{
+  // Baked for all the targets: the node rendering it finds it in the cache
+  QString error;
+  return get(source, stage, rhiTargets(stage), error).description();
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <QShaderBaker>
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+
+#include <atomic>
+#include <memory>
+
+class QRhi;
+
+// A shader being baked by a worker thread.
+// shader and error can be read once ready is set, completeShader once
+// complete is set.
+struct PendingShader
+{
+  // The SPIR-V and the variant of the backend in use
+  std::atomic_bool ready{};
+  QShader shader;
+  QString error;
+
+  // All the variants
+  std::atomic_bool complete{};
+  QShader completeShader;
+};
+
+// Baked shaders, indexed by a hash of their source, stage and targets.
+// They are kept in memory for the whole process, so that the instances of
+// a node bake their shaders once, and in the cache directory across sessions.
+struct ShaderCache
+{
+  using Targets = QVector<QShaderBaker::GeneratedShader>;
+
+  static ShaderCache& instance();
+
+  // What the nodes are baked to: one variant per QRhi backend.
+  // Compute shaders need a more recent GLSL version.
+  static const Targets& rhiTargets(QShader::Stage stage = QShader::VertexStage);
+
+  // The variant of the backend in use, baked before the others
+  void setActiveTarget(QShaderBaker::GeneratedShader target);
+
+  // On failure, the returned shader is invalid and error is set
+  QShader get(
+      const QString& source,
+      QShader::Stage stage,
+      const Targets& targets,
+      QString& error);
+
+  // Bakes the SPIR-V and the variant of the active backend on the thread
+  // pool, then the other variants which only go to the cache.
+  // Already set when the shader is in the cache.
+  std::shared_ptr<PendingShader> getAsync(const QString& source, QShader::Stage stage);
+
+  // The shader to use once baked, as long as it has the variant for the
+  // given QRhi, or all of them when it is null.
+  static const QShader* result(const PendingShader& pending, const QRhi* rhi);
+
+  // The reflection data, from the shader baked for rhiTargets(stage)
+  QShaderDescription reflect(const QString& source, QShader::Stage stage);
+
+private:
+  ShaderCache();
+
+  static QByteArray key(
+      const QString& source,
+      QShader::Stage stage,
+      const Targets& targets);
+  QString path(const QByteArray& key) const;
+
+  QShader find(const QByteArray& key);
+  QShader bake(
+      const QByteArray& key,
+      const QString& source,
+      QShader::Stage stage,
+      const Targets& targets,
+      QString& error,
+      bool persistent);
+
+  QMutex m_mutex;
+  QHash<QByteArray, QShader> m_shaders;
+  const QString m_directory;
+
+  QShaderBaker::GeneratedShader m_activeTarget{QShader::SpirvShader, 100};
+  QThreadPool m_pool;
+};
@@ -96,6 +96,7 @@ struct TexgenNode : NodeModel
       {
         f(const_cast<uchar*>(n.image.bits()), n.image.width(), n.image.height(), t++);
         res.uploadTexture(texture, n.image);
+        m_dirty = true;
       }
     }
 
@@ -105,13 +106,12 @@ struct TexgenNode : NodeModel
       texture = nullptr;
     }
 
-    /*
     std::optional<QSize> renderTargetSize() const noexcept override
     {
-      auto& decoder = *static_cast<const RGB0Node&>(node).decoder;
-      const auto w = decoder.width(), h = decoder.height();
-      return QSize{w, h};
-    }*/
+      if (auto sz = RenderedNode::renderTargetSize())
+        return sz;
+      return static_cast<const TexgenNode&>(node).image.size();
+    }
     int t = 0;
   };
 
@@ -19,6 +19,7 @@ enum class Types
   Image,
   Audio,
   Camera,
+  Buffer,
 };
 
 using ValueVariant = std::variant<
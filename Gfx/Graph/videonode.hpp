@@ -146,6 +146,7 @@ struct YUV420Node : NodeModel
           setVPixels(res, frame->data[2], frame->linesize[2]);
 
           framesToFree.push_back(frame);
+          m_dirty = true;
         }
         t.restart();
       }
@@ -203,6 +204,18 @@ struct YUV420Node : NodeModel
       QRhiTextureUploadDescription desc{entry};
       res.uploadTexture(v_tex, desc);
     }
+
+    std::optional<QSize> renderTargetSize() const noexcept override
+    {
+      if (auto sz = RenderedNode::renderTargetSize())
+        return sz;
+
+      auto& decoder = *static_cast<const YUV420Node&>(node).decoder;
+      const auto w = decoder.width(), h = decoder.height();
+      if (w <= 0 || h <= 0)
+        return {};
+      return QSize{w, h};
+    }
   };
 
   virtual ~YUV420Node() {}
@@ -286,6 +299,7 @@ struct RGB0Node : NodeModel
           setPixels(res, frame->data[0], frame->linesize[0]);
 
           framesToFree.push_back(frame);
+          m_dirty = true;
         }
         t.restart();
       }
@@ -311,13 +325,18 @@ struct RGB0Node : NodeModel
       QRhiTextureUploadDescription desc{entry};
       res.uploadTexture(y_tex, desc);
     }
-/*
+
     std::optional<QSize> renderTargetSize() const noexcept override
     {
+      if (auto sz = RenderedNode::renderTargetSize())
+        return sz;
+
       auto& decoder = *static_cast<const RGB0Node&>(node).decoder;
       const auto w = decoder.width(), h = decoder.height();
+      if (w <= 0 || h <= 0)
+        return {};
       return QSize{w, h};
-    }*/
+    }
   };
 
   const TexturedTriangle& m_mesh = TexturedTriangle::instance();
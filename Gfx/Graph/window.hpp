@@ -4,8 +4,36 @@
 #include "scene.hpp"
 
 #include <QPlatformSurfaceEvent>
+#include <QScreen>
+#include <QSemaphore>
+#include <QThread>
+#include <QTimer>
 
-class Window : public QWindow
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+
+// How regularly an output presents its frames. The intervals are in seconds.
+struct FrameStatistics
+{
+  int64_t frames{};
+  // Display refreshes skipped to stay at the target rate
+  int64_t skipped{};
+  // Intervals more than half a period longer than expected
+  int64_t late{};
+
+  double lastInterval{};
+  // Exponential moving average
+  double meanInterval{};
+  // Since the last call to Window::resetMaxInterval
+  double maxInterval{};
+};
+
+class Window
+    : public QWindow
+    , public std::enable_shared_from_this<Window>
 {
   GraphicsApi m_graphicsApi{};
 
@@ -33,6 +61,10 @@ public:
       default:
         break;
     }
+
+    // The screen can only be read on the GUI thread
+    connect(this, &QWindow::screenChanged, this, [this](QScreen* s) { watchScreen(s); });
+    watchScreen(screen());
   }
 
   ~Window()
@@ -43,10 +75,68 @@ public:
     state.release();
   }
 
+  // The window itself belongs to the GUI thread, but what is rendered in it
+  // belongs to the thread of the device: this has to be called there before
+  // the window is deleted.
+  void releaseResources()
+  {
+    releaseSwapChain();
+    state.release();
+    m_released = true;
+  }
+
+  // Object living on the thread which renders the window. When set, the
+  // frames are driven from that thread and the GUI thread only forwards
+  // the exposure of the window to it. Otherwise the window renders on the
+  // GUI thread, on each update request.
+  QObject* renderContext{};
+
   std::function<void()> onWindowReady;
+  // Called before each frame, out of it: applies what changed since the
+  // last one, up to the time at which the frame will be seen.
+  std::function<void(std::chrono::steady_clock::time_point)> onFrameStart;
   std::function<void()> onRender;
   std::function<void()> onResize;
   bool canRender{};
+
+  // Frames per second presented at most, e.g. 50 for a broadcast output
+  // on a 60 Hz display. Zero to follow the display.
+  double targetRate{};
+
+  // Seconds between the presentation of a frame and the moment it is seen
+  double latency{};
+
+  // Seconds between two refreshes of the screen of the window
+  double displayPeriod() const noexcept { return m_displayPeriod; }
+
+  // Of the windows sharing a render thread, only one waits for the
+  // vertical sync when presenting, and paces the thread: the others are
+  // presented right after it without waiting, so that they do not divide
+  // its rate. They may tear.
+  bool waitsForVSync{true};
+  QRhiSwapChain::Flags swapChainFlags() const noexcept
+  {
+    return waitsForVSync ? QRhiSwapChain::Flags{} : QRhiSwapChain::NoVSync;
+  }
+
+  // On the thread rendering the window: rebuilds the swap chain
+  void setWaitsForVSync(bool wait)
+  {
+    if (wait == waitsForVSync)
+      return;
+    waitsForVSync = wait;
+    if (!state.swapChain)
+      return;
+
+    releaseSwapChain();
+    state.swapChain->setFlags(swapChainFlags());
+    if (m_running)
+      resizeSwapChain();
+  }
+
+  const FrameStatistics& statistics() const noexcept { return m_statistics; }
+  // On the thread rendering the window
+  void resetMaxInterval() noexcept { m_statistics.maxInterval = 0.; }
   void init() { onWindowReady(); }
 
   void resizeSwapChain()
@@ -67,9 +157,12 @@ public:
 
   void render()
   {
+    m_frameRequested = false;
     if (!state.hasSwapChain || m_notExposed)
     {
-      requestUpdate();
+      // Rendering resumes once the window is exposed again
+      if (!renderContext)
+        requestUpdate();
       return;
     }
 
@@ -83,6 +176,19 @@ public:
       m_newlyExposed = false;
     }
 
+    if (!frameDue())
+    {
+      requestFrame(displayPeriod());
+      return;
+    }
+
+    // The frame is presented on the next refresh
+    if (onFrameStart)
+      onFrameStart(
+          clock::now()
+          + std::chrono::duration_cast<clock::duration>(
+              std::chrono::duration<double>(displayPeriod() + latency)));
+
     if(canRender)
     {
       QRhi::FrameOpResult r = state.rhi->beginFrame(state.swapChain, {});
@@ -91,14 +197,14 @@ public:
         resizeSwapChain();
         if (!state.hasSwapChain)
         {
-          requestUpdate();
+          requestFrame(displayPeriod());
           return;
         }
         r = state.rhi->beginFrame(state.swapChain);
       }
       if (r != QRhi::FrameOpSuccess)
       {
-        requestUpdate();
+        requestFrame(displayPeriod());
         return;
       }
 
@@ -114,14 +220,14 @@ public:
         resizeSwapChain();
         if (!state.hasSwapChain)
         {
-          requestUpdate();
+          requestFrame(displayPeriod());
           return;
         }
         r = state.rhi->beginFrame(state.swapChain);
       }
       if (r != QRhi::FrameOpSuccess)
       {
-        requestUpdate();
+        requestFrame(displayPeriod());
         return;
       }
 
@@ -132,33 +238,40 @@ public:
 
       state.rhi->endFrame(state.swapChain, {});
     }
-    requestUpdate();
+
+    // The swap chain waits for the display: the next frame can start
+    // right away. Otherwise, it starts one period after this one did.
+    if (waitsForVSync || !renderContext)
+    {
+      requestFrame(0.);
+    }
+    else
+    {
+      const double elapsed
+          = std::chrono::duration<double>(clock::now() - m_lastFrame).count();
+      requestFrame(std::max(displayPeriod() - elapsed, 0.));
+    }
   }
 
   void exposeEvent(QExposeEvent*) override
   {
-    if (isExposed() && !m_running)
+    if (!renderContext)
     {
-      m_running = true;
-      init();
-      resizeSwapChain();
+      exposed(isExposed());
+      return;
     }
 
-    const QSize surfaceSize
-        = state.hasSwapChain ? state.swapChain->surfacePixelSize() : QSize();
-
-    if ((!isExposed() || (state.hasSwapChain && surfaceSize.isEmpty()))
-        && m_running)
-      m_notExposed = true;
-
-    if (isExposed() && m_running && m_notExposed && !surfaceSize.isEmpty())
-    {
-      m_notExposed = false;
-      m_newlyExposed = true;
-    }
+    // The render thread may be gone already
+    if (m_released)
+      return;
 
-    if (isExposed() && !surfaceSize.isEmpty())
-      render();
+    QMetaObject::invokeMethod(
+        renderContext,
+        [w = weak_from_this(), isExposed = isExposed()] {
+          if (auto self = w.lock())
+            self->exposed(isExposed);
+        },
+        Qt::QueuedConnection);
   }
 
   void mouseDoubleClickEvent(QMouseEvent* ev) override
@@ -171,13 +284,34 @@ public:
     switch (e->type())
     {
       case QEvent::UpdateRequest:
-        render();
+        if (!renderContext)
+          render();
         break;
 
       case QEvent::PlatformSurface:
         if (static_cast<QPlatformSurfaceEvent*>(e)->surfaceEventType()
             == QPlatformSurfaceEvent::SurfaceAboutToBeDestroyed)
-          releaseSwapChain();
+        {
+          // The swap chain must be gone before the surface is. The render
+          // thread is only waited for a while, as it may be stopping.
+          if (!renderContext)
+          {
+            releaseSwapChain();
+          }
+          else if (!m_released && renderContext->thread()->isRunning())
+          {
+            auto done = std::make_shared<QSemaphore>();
+            QMetaObject::invokeMethod(
+                renderContext,
+                [w = weak_from_this(), done] {
+                  if (auto self = w.lock())
+                    self->releaseSwapChain();
+                  done->release();
+                },
+                Qt::QueuedConnection);
+            done->tryAcquire(1, 1000);
+          }
+        }
         break;
 
       default:
@@ -190,7 +324,132 @@ public:
   RenderState state;
 
 private:
+  using clock = std::chrono::steady_clock;
+
+  // On the thread rendering the window
+  void exposed(bool isExposed)
+  {
+    if (isExposed && !m_running)
+    {
+      m_running = true;
+      init();
+      resizeSwapChain();
+    }
+
+    const QSize surfaceSize
+        = state.hasSwapChain ? state.swapChain->surfacePixelSize() : QSize();
+
+    if ((!isExposed || (state.hasSwapChain && surfaceSize.isEmpty()))
+        && m_running)
+      m_notExposed = true;
+
+    if (isExposed && m_running && m_notExposed && !surfaceSize.isEmpty())
+    {
+      m_notExposed = false;
+      m_newlyExposed = true;
+    }
+
+    if (isExposed && !surfaceSize.isEmpty())
+    {
+      if (!renderContext)
+        render();
+      else
+        requestFrame(0.);
+    }
+  }
+
+  // Schedules the next call to render, after the given delay in seconds
+  // when rendering on another thread.
+  void requestFrame(double delay)
+  {
+    if (!renderContext)
+    {
+      requestUpdate();
+      return;
+    }
+
+    // Only one frame is pending at a time, whatever asked for it
+    if (m_frameRequested)
+      return;
+    m_frameRequested = true;
+
+    auto frame = [w = weak_from_this()] {
+      if (auto self = w.lock())
+        self->render();
+    };
+    if (delay > 0.)
+      QTimer::singleShot(
+          int(std::lround(delay * 1000.)), Qt::PreciseTimer, renderContext, frame);
+    else
+      QMetaObject::invokeMethod(renderContext, frame, Qt::QueuedConnection);
+  }
+
+  // On the GUI thread
+  void watchScreen(QScreen* screen)
+  {
+    disconnect(m_refreshRateChanged);
+    if (screen)
+      m_refreshRateChanged = connect(
+          screen, &QScreen::refreshRateChanged, this,
+          [this](qreal rate) { setRefreshRate(rate); });
+    setRefreshRate(screen ? screen->refreshRate() : 60.);
+  }
+
+  void setRefreshRate(double rate) noexcept
+  {
+    m_displayPeriod = 1. / (rate > 0. ? rate : 60.);
+  }
+
+  // Called on each display refresh: whether a frame is presented on this one
+  bool frameDue()
+  {
+    const auto now = clock::now();
+    const double display = displayPeriod();
+    const double period = targetRate > 0. ? 1. / targetRate : display;
+
+    if (m_lastFrame != clock::time_point{})
+    {
+      const auto due = m_lastFrame + std::chrono::duration_cast<clock::duration>(
+                           std::chrono::duration<double>(m_frameDebt + period));
+
+      // Presenting half a refresh early is closer than a whole one late
+      if (targetRate > 0. && now + std::chrono::duration_cast<clock::duration>(
+                                 std::chrono::duration<double>(display / 2.))
+                                 < due)
+      {
+        m_statistics.skipped++;
+        return false;
+      }
+
+      const double interval = std::chrono::duration<double>(now - m_lastFrame).count();
+      auto& s = m_statistics;
+      s.lastInterval = interval;
+      s.meanInterval = s.frames > 1 ? 0.95 * s.meanInterval + 0.05 * interval : interval;
+      s.maxInterval = std::max(s.maxInterval, interval);
+      if (interval > 1.5 * period)
+        s.late++;
+
+      // Frames rendered a bit early or late are compensated by the next
+      // ones, so that the average rate is the target one.
+      m_frameDebt = std::clamp(m_frameDebt + period - interval, -period / 2., period / 2.);
+    }
+
+    m_lastFrame = now;
+    m_statistics.frames++;
+    return true;
+  }
+
+  FrameStatistics m_statistics;
+  clock::time_point m_lastFrame{};
+  double m_frameDebt{};
+
   bool m_running = false;
   bool m_notExposed = false;
   bool m_newlyExposed = false;
+  bool m_frameRequested = false;
+  std::atomic_bool m_released{};
+
+  // Read by the thread rendering the window
+  std::atomic<double> m_displayPeriod{1. / 60.};
+  QMetaObject::Connection m_refreshRateChanged;
 };
@@ -21,7 +21,7 @@ public:
   image_node(const std::vector<Image>& dec, GfxExecutionAction& ctx)
       : gfx_exec_node{ctx}
   {
-    id = exec_context->ui->register_node(std::make_unique<ImagesNode>(dec));
+    id = exec_context->ui->register_node(std::make_unique<ImagesNode>(dec), mailbox);
   }
 
   ~image_node()
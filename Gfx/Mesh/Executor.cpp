@@ -28,7 +28,7 @@ public:
     static TextureNormalMesh icosahedron{mesh, idx, (int)ico.getVertexCount()};
     auto n = std::make_unique<PhongNode>(&icosahedron);
 
-    id = exec_context->ui->register_node(std::move(n));
+    id = exec_context->ui->register_node(std::move(n), mailbox);
   }
 
   ~mesh_node() { exec_context->ui->unregister_node(id); }
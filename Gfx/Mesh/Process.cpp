@@ -4,10 +4,11 @@
 #include <Process/Dataflow/WidgetInlets.hpp>
 
 #include <QFileInfo>
-#include <QShaderBaker>
+#include <QShader>
 
 #include <Gfx/Graph/node.hpp>
 #include <Gfx/Graph/nodes.hpp>
+#include <Gfx/Graph/shadercache.hpp>
 #include <Gfx/TexturePort.hpp>
 #include <wobjectimpl.h>
 W_OBJECT_IMPL(Gfx::Mesh::Model)
@@ -212,18 +213,12 @@ void Model::setupIsf(const isf::descriptor& desc)
 
 void Model::setupNormalShader()
 {
-  QShaderBaker b;
-  b.setSourceString(m_fragment.toLatin1(), QShader::Stage::FragmentStage);
-
-  b.setGeneratedShaders({
-             {QShader::SpirvShader, 100},
-             {QShader::GlslShader, 120}, // Only GLSL version supported by RHI right now.
-             {QShader::HlslShader, QShaderVersion(50)},
-             {QShader::MslShader, QShaderVersion(12)},
-  });
+  // Same targets as the node which renders it, so that it is baked only once
+  QString error;
+  auto s = ShaderCache::instance().get(
+      m_fragment, QShader::FragmentStage, ShaderCache::rhiTargets(), error);
 
   int i = 0;
-  auto s = b.bake();
 
   const auto& d = s.description();
 
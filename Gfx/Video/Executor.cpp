@@ -29,10 +29,10 @@ public:
     {
       case AV_PIX_FMT_YUV420P:
         id = exec_context->ui->register_node(
-            std::make_unique<YUV420Node>(dec));
+            std::make_unique<YUV420Node>(dec), mailbox);
         break;
       case AV_PIX_FMT_RGB0:
-        id = exec_context->ui->register_node(std::make_unique<RGB0Node>(dec));
+        id = exec_context->ui->register_node(std::make_unique<RGB0Node>(dec), mailbox);
         break;
       default:
         qDebug() << "Unhandled pixel format: "